@@ -1,345 +1,4230 @@
 #pragma once
 
+#include <algorithm>
+#include <atomic>
+#include <climits>
+#include <compare>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
 #include <iostream>
+#include <iterator>
 #include <memory>
+#include <mutex>
+#include <new>
+#include <stdexcept>
+#include <string_view>
+#include <thread>
 #include <type_traits>
+#include <typeinfo>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 
-namespace {
-struct BaseControlBlock {
-    uint shared_count = 0;
-    uint weak_count = 0;
+namespace detail {
+struct SingleThreadedCounting {
+    using Count = uint;
 
-    virtual void destroy() = 0;
-    virtual void deallocate() = 0;
-    virtual ~BaseControlBlock() = default;
+    static void increment(Count& count, uint n = 1) {
+        count += n;
+    }
+    static bool incrementIfNonZero(Count& count) {
+        if (count == 0) {
+            return false;
+        }
+        ++count;
+        return true;
+    }
+    // returns true when the last reference is gone
+    static bool decrement(Count& count, uint n = 1) {
+        count -= n;
+        return count == 0;
+    }
+    static bool isLast(const Count& count) {
+        return count == 1;
+    }
+    static uint load(const Count& count) {
+        return count;
+    }
 };
 
-template <typename T, typename Delete, typename Alloc>
-struct RegularControlBlock : BaseControlBlock {
-    using RCB_Alloc = typename std::allocator_traits<
-        Alloc>::template rebind_alloc<RegularControlBlock>;
-    using RCB_AllocTraits = std::allocator_traits<RCB_Alloc>;
-
-    T* ptr = nullptr;
-    [[no_unique_address]] Delete deleter;
-    [[no_unique_address]] Alloc allocator;
+struct MultiThreadedCounting {
+    using Count = std::atomic<uint>;
 
-    void destroy() override {
-        deleter(ptr);
-        ptr = nullptr;
+    static void increment(Count& count, uint n = 1) {
+        count.fetch_add(n, std::memory_order_relaxed);
     }
-    void deallocate() override {
-        RCB_Alloc RCB_allocator = std::move(allocator);
-        RCB_AllocTraits::deallocate(RCB_allocator, this, 1);
+    static bool incrementIfNonZero(Count& count) {
+        uint expected = count.load(std::memory_order_relaxed);
+        while (expected != 0) {
+            if (count.compare_exchange_weak(expected, expected + 1,
+                                            std::memory_order_relaxed)) {
+                return true;
+            }
+        }
+        return false;
     }
-
-    RegularControlBlock() {}
-    RegularControlBlock(uint shc, uint wc, T* other_ptr,
-                        const Delete& other_deleter,
-                        const Alloc& other_allocator) {
-        shared_count = shc;
-        weak_count = wc;
-        ptr = other_ptr;
-        deleter = other_deleter;
-        allocator = other_allocator;
+    // release on every decrement, acquire only for the one that hits zero:
+    // the acquire load reads the release sequence of all previous decrements
+    static bool decrement(Count& count, uint n = 1) {
+        if (count.fetch_sub(n, std::memory_order_release) == n) {
+            std::ignore = count.load(std::memory_order_acquire);
+            return true;
+        }
+        return false;
+    }
+    static bool isLast(const Count& count) {
+        return count.load(std::memory_order_acquire) == 1;
+    }
+    static uint load(const Count& count) {
+        return count.load(std::memory_order_relaxed);
     }
 };
 
-template <typename T, typename Alloc>
-struct MakeSharedControlBlock : BaseControlBlock {
-    using MSCB = MakeSharedControlBlock;
-    using MSCB_Alloc =
-        typename std::allocator_traits<Alloc>::template rebind_alloc<MSCB>;
-    using MSCB_AllocTraits = std::allocator_traits<MSCB_Alloc>;
-
-    char object[sizeof(T)];
-    [[no_unique_address]] Alloc allocator;
+#ifdef SMART_POINTERS_THREAD_SAFE
+using CountingPolicy = MultiThreadedCounting;
+#else
+using CountingPolicy = SingleThreadedCounting;
+#endif
 
-    template <typename... Args>
-    MakeSharedControlBlock(Args&&... args) {
-        new (reinterpret_cast<T*>(object)) T(std::forward<Args>(args)...);
-    }
+// The pointers built for sharing across threads static_assert on this, so
+// the default build rejects them instead of racing on plain counters. A
+// template so that only the ones actually used are checked.
+template <typename>
+inline constexpr bool kThreadSafeCounting =
+    std::is_same_v<CountingPolicy, MultiThreadedCounting>;
 
-    void destroy() override {
-        std::allocator_traits<Alloc>::destroy(allocator,
-                                              reinterpret_cast<T*>(object));
-    }
+enum class CountMode : uint8_t { Default, Biased, Sharded };
 
-    void deallocate() override {
-        MSCB_Alloc MSCB_allocator = std::move(allocator);
-        MSCB_AllocTraits::deallocate(MSCB_allocator, this, 1);
-    }
+// Promote is only ever sent to the blocks of allocateUniqueShareable, see
+// PromotionHooks.
+enum class ControlOp : uint8_t {
+    Destroy,
+    Deallocate,
+    DestroyAndDeallocate,
+    GetDeleter,
+    GetObject,
+    Promote
 };
 
-}  // namespace
+// identifies a deleter type in ControlOp::GetDeleter queries
+template <typename Delete>
+struct DeleterKey {
+    static constexpr char key = 0;
+};
 
+// identifies the object type in ControlOp::GetObject queries
 template <typename T>
-class WeakPtr;
+struct ObjectKey {
+    static constexpr char key = 0;
+};
 
+// the GetObject answer of a block that owns object
 template <typename T>
-class EnableSharedFromThis;
+void* objectIfKey(T* object, const void* key) {
+    using Object = std::remove_cv_t<T>;
+    return key == &ObjectKey<Object>::key ? const_cast<Object*>(object)
+                                          : nullptr;
+}
 
-template <typename T>
-class SharedPtr {
-  private:
-    T* ptr = nullptr;
-    BaseControlBlock* cb = nullptr;
+#ifdef SMART_POINTERS_STATS
+inline constexpr bool kStatsEnabled = true;
+#else
+inline constexpr bool kStatsEnabled = false;
+#endif
 
-    SharedPtr(const WeakPtr<T>& wp) : ptr(wp.ptr), cb(wp.cb) {
-        if (cb != nullptr) {
-            ++(cb->shared_count);
-        }
-    }
+enum class BlockKind : uint8_t { MakeShared, RawPointer, Array, Split, Batch };
+
+inline constexpr size_t kBlockKindCount = 5;
+
+struct SharedPtrTypeStats {
+    std::string_view name;
+    int64_t live = 0;
+    uint64_t created = 0;
+};
+
+struct SharedPtrSiteStats {
+    std::string_view site;
+    uint64_t created = 0;
+};
+
+struct SharedPtrStatsSnapshot {
+    uint64_t created_by_kind[kBlockKindCount] = {};
+    int64_t live_blocks = 0;
+    uint64_t increments = 0;
+    uint64_t decrements = 0;
+    uint64_t lock_hits = 0;
+    uint64_t lock_misses = 0;
+    int64_t weak_only_bytes = 0;
+    int64_t peak_weak_only_bytes = 0;
+    std::vector<SharedPtrTypeStats> types;
+    std::vector<SharedPtrSiteStats> sites;
+};
+
+// at most this many distinct SharedPtrStatsSite names are tracked
+inline constexpr size_t kMaxStatsSites = 64;
 
+// Backing store of the SMART_POINTERS_STATS hooks. Count traffic goes to
+// per-thread counters that only their thread writes; block lifetimes go to
+// per-type atomics, since they already pay for an allocation. Nothing here
+// allocates, so the hooks leave allocator traffic unchanged.
+class StatsRegistry {
   public:
-    SharedPtr() {}
+    struct ThreadCounters {
+        std::atomic<uint64_t> increments{0};
+        std::atomic<uint64_t> decrements{0};
+        std::atomic<uint64_t> lock_hits{0};
+        std::atomic<uint64_t> lock_misses{0};
+        ThreadCounters* next = nullptr;
+    };
 
-    SharedPtr(const SharedPtr& shp) : ptr(shp.ptr), cb(shp.cb) {
-        if (cb != nullptr) {
-            ++(cb->shared_count);
+    struct TypeEntry {
+        std::string_view name;
+        std::atomic<int64_t> live{0};
+        std::atomic<uint64_t> created{0};
+        TypeEntry* next = nullptr;
+    };
+
+    // written by one thread only, so no read-modify-write is needed
+    static void bump(std::atomic<uint64_t>& counter, uint64_t n) {
+        counter.store(counter.load(std::memory_order_relaxed) + n,
+                      std::memory_order_relaxed);
+    }
+
+    static ThreadCounters& local() {
+        thread_local LocalCounters counters;
+        return counters.counters;
+    }
+
+    template <typename T>
+    static TypeEntry& typeEntry() {
+        static TypeEntry& entry = registerType<T>(typeid(T).name());
+        return entry;
+    }
+
+    static void blockCreated(TypeEntry& type, BlockKind kind) {
+        type.created.fetch_add(1, std::memory_order_relaxed);
+        type.live.fetch_add(1, std::memory_order_relaxed);
+        global().created_by_kind[static_cast<size_t>(kind)].fetch_add(
+            1, std::memory_order_relaxed);
+        if (currentSite() != nullptr) {
+            recordSite(currentSite());
         }
     }
 
-    SharedPtr(SharedPtr&& shp) : ptr(shp.ptr), cb(shp.cb) {
-        shp.cb = nullptr;
-        shp.ptr = nullptr;
+    static void blockFreed(TypeEntry& type) {
+        type.live.fetch_sub(1, std::memory_order_relaxed);
     }
 
-    SharedPtr& operator=(const SharedPtr& shp) {
-        if (this == &shp) {
-            return *this;
+    static void weakOnly(int64_t bytes) {
+        Global& stats = global();
+        int64_t held =
+            stats.weak_only_bytes.fetch_add(bytes, std::memory_order_relaxed) +
+            bytes;
+        std::atomic<int64_t>& peak_bytes = stats.peak_weak_only_bytes;
+        int64_t peak = peak_bytes.load(std::memory_order_relaxed);
+        while (held > peak && !peak_bytes.compare_exchange_weak(
+                                  peak, held, std::memory_order_relaxed)) {
         }
-        SharedPtr copy(shp);
-        swap(copy);
-        return *this;
     }
 
-    SharedPtr& operator=(SharedPtr&& shp) {
-        SharedPtr copy(std::move(shp));
-        swap(copy);
-        return *this;
+    static const char*& currentSite() {
+        thread_local const char* site = nullptr;
+        return site;
     }
 
-    ~SharedPtr() {
-        if (cb == nullptr) {
-            return;
+    static SharedPtrStatsSnapshot snapshot() {
+        Global& stats = global();
+        SharedPtrStatsSnapshot result;
+        std::lock_guard lock(stats.mutex);
+        for (size_t kind = 0; kind < kBlockKindCount; ++kind) {
+            result.created_by_kind[kind] =
+                stats.created_by_kind[kind].load(std::memory_order_relaxed);
         }
-        --(cb->shared_count);
-        if (cb->shared_count == 0) {
-            if (cb->weak_count == 0) {
-                cb->destroy();
-                cb->deallocate();
-            } else {
-                cb->destroy();
-            }
+        addCounters(result, stats.retired);
+        for (ThreadCounters* counters = stats.threads; counters != nullptr;
+             counters = counters->next) {
+            addCounters(result, *counters);
+        }
+        result.weak_only_bytes =
+            stats.weak_only_bytes.load(std::memory_order_relaxed);
+        result.peak_weak_only_bytes =
+            stats.peak_weak_only_bytes.load(std::memory_order_relaxed);
+        for (TypeEntry* type = stats.types; type != nullptr;
+             type = type->next) {
+            SharedPtrTypeStats entry{
+                type->name, type->live.load(std::memory_order_relaxed),
+                type->created.load(std::memory_order_relaxed)};
+            result.live_blocks += entry.live;
+            result.types.push_back(entry);
         }
+        result.sites.assign(stats.sites, stats.sites + stats.site_count);
+        return result;
     }
 
-    template <typename U>
-    SharedPtr(SharedPtr<U> shp) : ptr(shp.ptr), cb(shp.cb) {
-        if (cb) {
-            ++(cb->shared_count);
+  private:
+    struct Global {
+        std::mutex mutex;
+        ThreadCounters* threads = nullptr;
+        ThreadCounters retired;
+        TypeEntry* types = nullptr;
+        SharedPtrSiteStats sites[kMaxStatsSites];
+        size_t site_count = 0;
+        std::atomic<uint64_t> created_by_kind[kBlockKindCount] = {};
+        std::atomic<int64_t> weak_only_bytes{0};
+        std::atomic<int64_t> peak_weak_only_bytes{0};
+    };
+
+    // registers with the global list and hands its totals over at exit
+    struct LocalCounters {
+        ThreadCounters counters;
+
+        LocalCounters() {
+            std::lock_guard lock(global().mutex);
+            counters.next = std::exchange(global().threads, &counters);
+        }
+        LocalCounters(const LocalCounters&) = delete;
+        LocalCounters& operator=(const LocalCounters&) = delete;
+        ~LocalCounters() {
+            Global& stats = global();
+            std::lock_guard lock(stats.mutex);
+            ThreadCounters** link = &stats.threads;
+            while (*link != &counters) {
+                link = &(*link)->next;
+            }
+            *link = counters.next;
+            bump(stats.retired.increments, counters.increments);
+            bump(stats.retired.decrements, counters.decrements);
+            bump(stats.retired.lock_hits, counters.lock_hits);
+            bump(stats.retired.lock_misses, counters.lock_misses);
         }
+    };
+
+    static Global& global() {
+        static Global stats;
+        return stats;
     }
 
-    template <typename U>
-    SharedPtr(U* other_ptr) {
-        ptr = other_ptr;
-        cb = new RegularControlBlock<T, std::default_delete<U>,
-                                     std::allocator<U>>(
-            1, 0, ptr, std::default_delete<U>(), std::allocator<U>());
+    // one entry per type, owned by the caller's function-local static
+    template <typename T>
+    static TypeEntry& registerType(std::string_view name) {
+        static TypeEntry entry;
+        entry.name = name;
+        std::lock_guard lock(global().mutex);
+        entry.next = std::exchange(global().types, &entry);
+        return entry;
+    }
 
-        if constexpr (std::is_base_of_v<EnableSharedFromThis<U>, U>) {
-            other_ptr->enable_wp = *this;
+    static void recordSite(std::string_view site) {
+        Global& stats = global();
+        std::lock_guard lock(stats.mutex);
+        for (size_t i = 0; i < stats.site_count; ++i) {
+            if (stats.sites[i].site == site) {
+                ++stats.sites[i].created;
+                return;
+            }
+        }
+        if (stats.site_count < kMaxStatsSites) {
+            stats.sites[stats.site_count++] = {site, 1};
         }
     }
 
-    template <typename U, typename Delete>
-    SharedPtr(U* other_ptr, Delete deleter) {
-        ptr = other_ptr;
-        cb = new RegularControlBlock<T, Delete, std::allocator<U>>(
-            1, 0, ptr, deleter, std::allocator<U>());
+    static void addCounters(SharedPtrStatsSnapshot& result,
+                            const ThreadCounters& counters) {
+        auto load = [](const std::atomic<uint64_t>& counter) {
+            return counter.load(std::memory_order_relaxed);
+        };
+        result.increments += load(counters.increments);
+        result.decrements += load(counters.decrements);
+        result.lock_hits += load(counters.lock_hits);
+        result.lock_misses += load(counters.lock_misses);
+    }
+};
 
-        if constexpr (std::is_base_of_v<EnableSharedFromThis<U>, U>) {
-            other_ptr->enable_wp = *this;
+// Instrumentation points. Without SMART_POINTERS_STATS every hook is an
+// empty inline function.
+struct StatsHooks {
+    static void sharedAdded(uint n) {
+        if constexpr (kStatsEnabled) {
+            StatsRegistry::bump(StatsRegistry::local().increments, n);
+        }
+    }
+    static void sharedReleased(uint n) {
+        if constexpr (kStatsEnabled) {
+            StatsRegistry::bump(StatsRegistry::local().decrements, n);
+        }
+    }
+    static void locked(bool hit) {
+        if constexpr (kStatsEnabled) {
+            StatsRegistry::ThreadCounters& counters = StatsRegistry::local();
+            StatsRegistry::bump(hit ? counters.lock_hits : counters.lock_misses,
+                                1);
+        }
+    }
+    template <typename T>
+    static void blockCreated(BlockKind kind) {
+        if constexpr (kStatsEnabled) {
+            StatsRegistry::blockCreated(StatsRegistry::typeEntry<T>(), kind);
+        }
+    }
+    // op is the manager operation about to free bytes of block memory:
+    // Destroy leaves the block to its WeakPtrs, Deallocate frees it
+    template <typename T>
+    static void blockManaged(ControlOp op, size_t bytes) {
+        if constexpr (kStatsEnabled) {
+            if (op == ControlOp::Destroy) {
+                StatsRegistry::weakOnly(static_cast<int64_t>(bytes));
+            } else if (op == ControlOp::Deallocate) {
+                StatsRegistry::weakOnly(-static_cast<int64_t>(bytes));
+            }
+            if (op == ControlOp::Deallocate ||
+                op == ControlOp::DestroyAndDeallocate) {
+                StatsRegistry::blockFreed(StatsRegistry::typeEntry<T>());
+            }
         }
     }
+};
 
-    template <typename U, typename Delete, typename Alloc>
-    SharedPtr(U* other_ptr, Delete deleter, Alloc allocator) {
-        ptr = other_ptr;
+// Attributes blocks created on this thread to site while in scope, e.g.
+// SharedPtrStatsSite site("cache fill"); site must be a string literal.
+class SharedPtrStatsSite {
+  public:
+    explicit SharedPtrStatsSite(const char* site) {
+        if constexpr (kStatsEnabled) {
+            previous = std::exchange(StatsRegistry::currentSite(), site);
+        }
+    }
+    SharedPtrStatsSite(const SharedPtrStatsSite&) = delete;
+    SharedPtrStatsSite& operator=(const SharedPtrStatsSite&) = delete;
+    ~SharedPtrStatsSite() {
+        if constexpr (kStatsEnabled) {
+            StatsRegistry::currentSite() = previous;
+        }
+    }
 
-        using RCB = RegularControlBlock<T, Delete, Alloc>;
-        using RCB_Alloc = typename RCB::RCB_Alloc;
-        using RCB_AllocTraits = std::allocator_traits<RCB_Alloc>;
+  private:
+    const char* previous = nullptr;
+};
 
-        RCB_Alloc RCB_allocator = std::move(allocator);
-        RCB* RCB_ptr = RCB_AllocTraits::allocate(RCB_allocator, 1);
-        new (RCB_ptr) RegularControlBlock<T, Delete, Alloc>();
-        cb = RCB_ptr;
-        RCB_ptr->shared_count = 1;
-        RCB_ptr->deleter = deleter;
-        RCB_ptr->allocator = std::move(RCB_allocator);
+// all zero unless built with SMART_POINTERS_STATS
+inline SharedPtrStatsSnapshot sharedPtrStats() {
+    if constexpr (kStatsEnabled) {
+        return StatsRegistry::snapshot();
+    }
+    return {};
+}
 
-        if constexpr (std::is_base_of_v<EnableSharedFromThis<U>, U>) {
-            other_ptr->enable_wp = *this;
+// Prints the totals followed by a leak report: every type that still has
+// live blocks.
+inline void dumpSharedPtrStats(std::ostream& out) {
+    static constexpr const char* kKindNames[kBlockKindCount] = {
+        "make_shared", "raw_pointer", "array", "split", "batch"};
+    SharedPtrStatsSnapshot stats = sharedPtrStats();
+    out << "shared_ptr stats:\n";
+    for (size_t kind = 0; kind < kBlockKindCount; ++kind) {
+        out << "  created " << kKindNames[kind] << ": "
+            << stats.created_by_kind[kind] << "\n";
+    }
+    out << "  live blocks: " << stats.live_blocks << "\n"
+        << "  increments: " << stats.increments << "\n"
+        << "  decrements: " << stats.decrements << "\n"
+        << "  lock hits: " << stats.lock_hits << "\n"
+        << "  lock misses: " << stats.lock_misses << "\n"
+        << "  weak-only bytes: " << stats.weak_only_bytes << " (peak "
+        << stats.peak_weak_only_bytes << ")\n";
+    for (const SharedPtrSiteStats& site : stats.sites) {
+        out << "  site " << site.site << ": " << site.created << "\n";
+    }
+    for (const SharedPtrTypeStats& type : stats.types) {
+        if (type.live > 0) {
+            out << "  leaked " << type.name << ": " << type.live << " of "
+                << type.created << "\n";
         }
     }
+}
 
-    uint use_count() const {
-        return cb == nullptr ? 0 : cb->shared_count;
-    }
+// All SharedPtr owners together hold one weak reference, so the block is
+// deallocated exactly once by whoever drops weak_count to zero.
+// Instead of a vtable every block stores one manager function that
+// destroys the object and/or frees the block. GetDeleter returns the
+// block's deleter if its DeleterKey matches key, and nullptr otherwise;
+// GetObject likewise returns the object if it was created as the type of
+// that ObjectKey.
+struct BaseControlBlock {
+    using Manager = void* (*)(BaseControlBlock*, ControlOp, const void* key);
 
-    void reset() {
-        SharedPtr().swap(*this);
+    Manager manager;
+    CountingPolicy::Count shared_count{0};
+    CountingPolicy::Count weak_count{0};
+    CountMode count_mode = CountMode::Default;
+    // set by WeakPtrTable, which wants to hear when the object dies
+    std::atomic<bool> watched{false};
+    // objects deriving from EnableIterativeDestruction
+    bool iterative = false;
+
+    explicit BaseControlBlock(Manager manager) : manager(manager) {}
+
+    void destroy() {
+        manager(this, ControlOp::Destroy, nullptr);
     }
-    template <typename U>
-    void reset(U* other_ptr) {
-        SharedPtr<T>(other_ptr).swap(*this);
+    void deallocate() {
+        manager(this, ControlOp::Deallocate, nullptr);
     }
 
-    void swap(SharedPtr& shp) {
-        std::swap(cb, shp.cb);
-        std::swap(ptr, shp.ptr);
+    // n > 1 applies several references in one update, see shareN()
+    void addShared(uint n = 1) {
+        StatsHooks::sharedAdded(n);
+        if (count_mode != CountMode::Default) {
+            addSharedSlow(n);
+            return;
+        }
+        CountingPolicy::increment(shared_count, n);
     }
-
-    T& operator*() const {
-        return *ptr;
+    bool tryAddShared() {
+        if (count_mode != CountMode::Default) {
+            return tryAddSharedSlow();
+        }
+        return CountingPolicy::incrementIfNonZero(shared_count);
     }
-
-    T* operator->() const {
-        return ptr;
+    void addWeak() {
+        CountingPolicy::increment(weak_count);
     }
-
-    T* get() const {
-        return ptr;
+    void releaseShared(uint n = 1) {
+        StatsHooks::sharedReleased(n);
+        if (count_mode != CountMode::Default
+                ? !releaseSharedSlow(n)
+                : !CountingPolicy::decrement(shared_count, n)) {
+            return;
+        }
+        releasedLast();
+    }
+    // called once the last shared reference is gone
+    void releasedLast() {
+        if (watched.load(std::memory_order_relaxed)) {
+            reportExpired();
+        }
+        if (iterative) {
+            finishIteratively();
+            return;
+        }
+        finishRelease();
+    }
+    void releaseWeak() {
+        if (CountingPolicy::decrement(weak_count)) {
+            deallocate();
+        }
+    }
+    uint sharedCount() const {
+        if (count_mode != CountMode::Default) {
+            return sharedCountSlow();
+        }
+        return CountingPolicy::load(shared_count);
     }
 
-    template <typename U, typename Alloc, typename... Args>
-    friend SharedPtr<U> allocateShared(const Alloc&, Args&&...);
+  private:
+    // biased and sharded blocks keep their counts elsewhere; kept out of
+    // line so the default path stays small
+    [[gnu::noinline]] inline void addSharedSlow(uint n);
+    [[gnu::noinline]] inline bool tryAddSharedSlow();
+    [[gnu::noinline]] inline bool releaseSharedSlow(uint n);
+    [[gnu::noinline]] inline uint sharedCountSlow() const;
 
-    template <typename U>
-    friend class WeakPtr;
+    [[gnu::noinline]] inline void finishIteratively();
 
-    template <typename U>
-    friend class SharedPtr;
+    void finishRelease() {
+        // no WeakPtr left and none can appear: finish in a single call
+        if (CountingPolicy::isLast(weak_count)) {
+            manager(this, ControlOp::DestroyAndDeallocate, nullptr);
+            return;
+        }
+        destroy();
+        releaseWeak();
+    }
+
+  public:
+    [[gnu::noinline]] inline void reportExpired();
 };
 
-template <typename T>
-class WeakPtr {
-  private:
-    T* ptr = nullptr;
-    BaseControlBlock* cb = nullptr;
+struct ControlBlockPoolStats {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t releases = 0;
+    uint64_t overflows = 0;
+    // released here, sent back to the allocating thread
+    uint64_t returns = 0;
+
+    double hitRate() const {
+        uint64_t requests = hits + misses;
+        return requests == 0 ? 0.0
+                             : static_cast<double>(hits) /
+                                   static_cast<double>(requests);
+    }
+};
 
+// Per-thread size-class freelists for the blocks of the raw-pointer
+// constructors. Every pooled block is preceded by a header naming the
+// Depot of the thread that allocated it. A block released on another thread
+// is pushed onto that depot's return list, which the owner takes over on
+// its next miss. Beyond kMaxCached per class blocks go back to operator
+// delete, as does everything cached when the thread exits; blocks still out
+// then are deleted by whoever releases them, and the last of them frees the
+// depot.
+class ControlBlockPool {
   public:
-    WeakPtr() {}
+    static constexpr size_t kGranularity = 16;
+    static constexpr size_t kClassCount = 8;
+    static constexpr uint kMaxCached = 1024;
 
-    template <typename U>
-    WeakPtr(SharedPtr<U> shp) : ptr(shp.ptr), cb(shp.cb) {
-        if (cb) {
-            ++(cb->weak_count);
+    static void* allocate(size_t size, size_t align) {
+        size_t index = classIndex(size, align);
+        if (index == kClassCount) {
+            return ::operator new(size, std::align_val_t(align));
+        }
+        State& pool = state();
+        if (pool.free_lists[index] == nullptr) {
+            collectReturns(pool);
+        }
+        Header* header = pool.free_lists[index];
+        if (header != nullptr) {
+            ++pool.stats.hits;
+            pool.free_lists[index] = nextOf(header);
+            --pool.cached[index];
+            ++pool.outstanding;
+            return header + 1;
+        }
+        ++pool.stats.misses;
+        header = static_cast<Header*>(
+            ::operator new(sizeof(Header) + classSize(index)));
+        header->index = index;
+        header->owner = nullptr;
+        if (!pool.closed) {
+            if (pool.depot == nullptr) {
+                pool.depot = new Depot;
+            }
+            header->owner = pool.depot;
+            ++pool.outstanding;
         }
+        return header + 1;
     }
 
-    WeakPtr(const WeakPtr& wp) : ptr(wp.ptr), cb(wp.cb) {
-        if (cb != nullptr) {
-            ++(cb->weak_count);
+    static void deallocate(void* ptr, size_t size, size_t align) {
+        size_t index = classIndex(size, align);
+        if (index == kClassCount) {
+            ::operator delete(ptr, std::align_val_t(align));
+            return;
+        }
+        Header* header = static_cast<Header*>(ptr) - 1;
+        State& pool = state();
+        ++pool.stats.releases;
+        if (header->owner == nullptr) {
+            ::operator delete(header);
+        } else if (header->owner == pool.depot && !pool.closed) {
+            --pool.outstanding;
+            cache(pool, header);
+        } else {
+            ++pool.stats.returns;
+            giveBack(header);
         }
     }
 
-    WeakPtr(WeakPtr&& wp) : ptr(wp.ptr), cb(wp.cb) {
-        wp.ptr = nullptr;
-        wp.cb = nullptr;
+    static void trim() {
+        State& pool = state();
+        collectReturns(pool);
+        for (size_t index = 0; index < kClassCount; ++index) {
+            while (pool.free_lists[index] != nullptr) {
+                Header* header = pool.free_lists[index];
+                pool.free_lists[index] = nextOf(header);
+                ::operator delete(header);
+            }
+            pool.cached[index] = 0;
+        }
     }
 
-    WeakPtr& operator=(const WeakPtr& wp) {
-        WeakPtr copy(wp);
-        swap(copy);
-        return *this;
+    static ControlBlockPoolStats stats() {
+        return state().stats;
     }
 
-    WeakPtr& operator=(WeakPtr&& wp) {
-        WeakPtr copy(std::move(wp));
-        swap(copy);
-        return *this;
+  private:
+    struct Depot;
+
+    // the free list link lives in the block itself
+    struct alignas(kGranularity) Header {
+        Depot* owner;
+        size_t index;
+    };
+
+    // shared by a thread and every thread that releases its blocks
+    struct Depot {
+        std::atomic<Header*> returned{nullptr};
+        // blocks out when the owner exited, less those given back since
+        std::atomic<int64_t> remaining{0};
+    };
+
+    struct State {
+        Header* free_lists[kClassCount] = {};
+        uint cached[kClassCount] = {};
+        ControlBlockPoolStats stats;
+        Depot* depot = nullptr;
+        // blocks of depot neither cached here nor on its return list
+        int64_t outstanding = 0;
+        bool closed = false;
+    };
+
+    // frees the cache at thread exit; State itself stays usable afterwards
+    struct Reaper {
+        explicit Reaper(State& pool) : pool(pool) {}
+        Reaper(const Reaper&) = delete;
+        Reaper& operator=(const Reaper&) = delete;
+        ~Reaper() {
+            trim();
+            pool.closed = true;
+            Depot* depot = pool.depot;
+            if (depot == nullptr) {
+                return;
+            }
+            Header* returned =
+                depot->returned.exchange(orphaned(), std::memory_order_acquire);
+            while (returned != nullptr) {
+                Header* next = nextOf(returned);
+                ::operator delete(returned);
+                --pool.outstanding;
+                returned = next;
+            }
+            if (depot->remaining.fetch_add(pool.outstanding,
+                                           std::memory_order_acq_rel) +
+                    pool.outstanding ==
+                0) {
+                delete depot;
+            }
+        }
+
+        State& pool;
+    };
+
+    static State& state() {
+        thread_local State pool;
+        thread_local Reaper reaper(pool);
+        return pool;
     }
 
-    ~WeakPtr() {
-        if (cb == nullptr) {
+    static Header*& nextOf(Header* header) {
+        return *reinterpret_cast<Header**>(header + 1);
+    }
+
+    // marks the return list of a depot whose thread has exited
+    static Header* orphaned() {
+        static Header mark{};
+        return &mark;
+    }
+
+    static void cache(State& pool, Header* header) {
+        size_t index = header->index;
+        if (pool.closed || pool.cached[index] == kMaxCached) {
+            ++pool.stats.overflows;
+            ::operator delete(header);
+            return;
+        }
+        nextOf(header) = pool.free_lists[index];
+        pool.free_lists[index] = header;
+        ++pool.cached[index];
+    }
+
+    static void collectReturns(State& pool) {
+        if (pool.depot == nullptr || pool.closed ||
+            pool.depot->returned.load(std::memory_order_relaxed) == nullptr) {
             return;
         }
-        --(cb->weak_count);
-        if (cb->weak_count == 0 && cb->shared_count == 0) {
-            cb->deallocate();
+        Header* returned =
+            pool.depot->returned.exchange(nullptr, std::memory_order_acquire);
+        while (returned != nullptr) {
+            Header* next = nextOf(returned);
+            --pool.outstanding;
+            cache(pool, returned);
+            returned = next;
         }
     }
 
-    void swap(WeakPtr& wp) {
-        std::swap(ptr, wp.ptr);
-        std::swap(cb, wp.cb);
+    static void giveBack(Header* header) {
+        Depot* depot = header->owner;
+        Header* head = depot->returned.load(std::memory_order_relaxed);
+        do {
+            if (head == orphaned()) {
+                ::operator delete(header);
+                if (depot->remaining.fetch_sub(1, std::memory_order_acq_rel) ==
+                    1) {
+                    delete depot;
+                }
+                return;
+            }
+            nextOf(header) = head;
+        } while (!depot->returned.compare_exchange_weak(
+            head, header, std::memory_order_release,
+            std::memory_order_relaxed));
     }
 
-    template <typename U>
-    WeakPtr(WeakPtr<U> wp) : ptr(wp.ptr), cb(wp.cb) {
-        if (cb) {
-            ++(cb->weak_count);
+    static size_t classIndex(size_t size, size_t align) {
+        if (align > kGranularity || size > kGranularity * kClassCount) {
+            return kClassCount;
         }
+        return (size - 1) / kGranularity;
     }
-
-    bool expired() const {
-        return cb == nullptr || cb->shared_count == 0;
+    static size_t classSize(size_t index) {
+        return (index + 1) * kGranularity;
     }
+};
+
+// Allocator over ControlBlockPool, used by default for the blocks of
+// SharedPtr(U*) and SharedPtr(U*, Delete).
+template <typename T>
+struct PoolAllocator {
+    using value_type = T;
+
+    PoolAllocator() = default;
 
-    SharedPtr<T> lock() const {
-        return expired() ? SharedPtr<T>() : SharedPtr<T>(*this);
+    template <typename U>
+    PoolAllocator(const PoolAllocator<U>& /*unused*/) {}
+
+    T* allocate(size_t n) {
+        return static_cast<T*>(
+            ControlBlockPool::allocate(n * sizeof(T), alignof(T)));
     }
 
-    uint use_count() const {
-        return cb == nullptr ? 0 : cb->shared_count;
+    void deallocate(T* ptr, size_t n) {
+        ControlBlockPool::deallocate(ptr, n * sizeof(T), alignof(T));
     }
-    template <typename U>
-    friend class SharedPtr;
 
     template <typename U>
-    friend class WeakPtr;
+    bool operator==(const PoolAllocator<U>& /*unused*/) const {
+        return true;
+    }
 };
 
-template <typename T>
-class EnableSharedFromThis {
-  private:
-    WeakPtr<T> enable_wp;
+template <typename T, typename Delete, typename Alloc>
+struct RegularControlBlock : BaseControlBlock {
+    using RCB_Alloc = typename std::allocator_traits<
+        Alloc>::template rebind_alloc<RegularControlBlock>;
+    using RCB_AllocTraits = std::allocator_traits<RCB_Alloc>;
 
-  public:
-    SharedPtr<T> shared_from_this() const {
-        return SharedPtr<T>(enable_wp);
+    T* ptr;
+    [[no_unique_address]] Delete deleter;
+    [[no_unique_address]] RCB_Alloc allocator;
+
+    static void* manage(BaseControlBlock* base, ControlOp op,
+                        const void* key) {
+        auto* self = static_cast<RegularControlBlock*>(base);
+        if (op == ControlOp::GetDeleter) {
+            return key == &DeleterKey<Delete>::key ? &self->deleter : nullptr;
+        }
+        if (op == ControlOp::GetObject) {
+            return objectIfKey(self->ptr, key);
+        }
+        StatsHooks::blockManaged<T>(op, sizeof(RegularControlBlock));
+        if (op != ControlOp::Deallocate) {
+            self->deleter(self->ptr);
+            self->ptr = nullptr;
+        }
+        if (op != ControlOp::Destroy) {
+            RCB_Alloc RCB_allocator = std::move(self->allocator);
+            self->~RegularControlBlock();
+            RCB_AllocTraits::deallocate(RCB_allocator, self, 1);
+        }
+        return nullptr;
     }
 
-    template <typename U>
-    friend class SharePtr;
+    // deleter and allocator are moved or copied in exactly once; the
+    // creator reports the block to StatsHooks, see tryInitControlBlock
+    template <typename D, typename A>
+    RegularControlBlock(T* other_ptr, D&& other_deleter,
+                        A&& other_allocator) noexcept(
+        std::is_nothrow_constructible_v<Delete, D> &&
+        std::is_nothrow_constructible_v<RCB_Alloc, A>)
+        : BaseControlBlock(&manage),
+          ptr(other_ptr),
+          deleter(std::forward<D>(other_deleter)),
+          allocator(std::forward<A>(other_allocator)) {}
 };
 
-template <typename T, typename Alloc, typename... Args>
-SharedPtr<T> allocateShared(const Alloc& alloc,
-                            Args&&... args) {  // todo do const Alloc
+inline constexpr size_t kCacheLineSize = 64;
 
-    using MSCB = MakeSharedControlBlock<T, Alloc>;
-    using MSCB_Alloc =
+// A UniquePtr may have been converted to a base of the type its object was
+// made as, which only the block still knows. When the UniquePtr becomes a
+// SharedPtr, the block's manager passes the object here, and its
+// EnableSharedFromThis base is pointed at the block. Defined with SharedPtr.
+struct PromotionHooks {
+    template <typename T>
+    static void promoted(T* object, BaseControlBlock* block);
+};
+
+// Requests default-initialization (no zeroing) of fused objects; like
+// std::allocate_shared_for_overwrite it bypasses Alloc::construct.
+struct DefaultInit {};
+
+template <typename T, typename Alloc, typename Base = BaseControlBlock,
+          size_t Align = alignof(T)>
+struct MakeSharedControlBlock : Base {
+    using MSCB = MakeSharedControlBlock;
+    using MSCB_Alloc =
+        typename std::allocator_traits<Alloc>::template rebind_alloc<MSCB>;
+    using MSCB_AllocTraits = std::allocator_traits<MSCB_Alloc>;
+
+    // over-aligned T makes the whole block over-aligned, and
+    // allocator_traits<MSCB_Alloc> then requests that alignment
+    alignas(Align) char object[sizeof(T)];
+    [[no_unique_address]] Alloc allocator;
+
+    template <typename... Args>
+    MakeSharedControlBlock(std::allocator_arg_t /*unused*/,
+                           const Alloc& other_allocator, Args&&... args)
+        : Base(&manage), allocator(other_allocator) {
+        new (object) T(std::forward<Args>(args)...);
+        StatsHooks::blockCreated<T>(BlockKind::MakeShared);
+    }
+
+    MakeSharedControlBlock(std::allocator_arg_t /*unused*/,
+                           const Alloc& other_allocator, DefaultInit /*unused*/)
+        : Base(&manage), allocator(other_allocator) {
+        new (object) T;
+        StatsHooks::blockCreated<T>(BlockKind::MakeShared);
+    }
+
+    T* getObject() {
+        return std::launder(reinterpret_cast<T*>(object));
+    }
+
+    static void* manage(BaseControlBlock* base, ControlOp op,
+                        const void* key) {
+        auto* self = static_cast<MSCB*>(base);
+        if (op == ControlOp::GetDeleter) {
+            return nullptr;
+        }
+        if (op == ControlOp::GetObject) {
+            return objectIfKey(self->getObject(), key);
+        }
+        if (op == ControlOp::Promote) {
+            PromotionHooks::promoted(self->getObject(), base);
+            return nullptr;
+        }
+        StatsHooks::blockManaged<T>(op, sizeof(MSCB));
+        if (op != ControlOp::Deallocate) {
+            std::allocator_traits<Alloc>::destroy(
+                self->allocator, self->getObject());
+        }
+        if (op != ControlOp::Destroy) {
+            MSCB_Alloc MSCB_allocator = std::move(self->allocator);
+            self->~MakeSharedControlBlock();
+            MSCB_AllocTraits::deallocate(MSCB_allocator, self, 1);
+        }
+        return nullptr;
+    }
+};
+
+// Counters and object live in separate allocations, so the object's memory
+// is given back as soon as the last SharedPtr goes, even while WeakPtrs keep
+// the counters around. Only allocateSharedSplit builds these; makeShared
+// stays fused whatever the size, which CompactSharedPtr relies on.
+template <typename T, typename Alloc>
+struct SplitControlBlock : BaseControlBlock {
+    using Object_Alloc =
+        typename std::allocator_traits<Alloc>::template rebind_alloc<T>;
+    using Object_AllocTraits = std::allocator_traits<Object_Alloc>;
+    using SCB_Alloc = typename std::allocator_traits<
+        Alloc>::template rebind_alloc<SplitControlBlock>;
+    using SCB_AllocTraits = std::allocator_traits<SCB_Alloc>;
+
+    T* object = nullptr;
+    [[no_unique_address]] Object_Alloc allocator;
+
+    template <typename... Args>
+    SplitControlBlock(const Alloc& other_allocator, Args&&... args)
+        : BaseControlBlock(&manage), allocator(other_allocator) {
+        object = Object_AllocTraits::allocate(allocator, 1);
+        try {
+            construct(std::forward<Args>(args)...);
+        } catch (...) {
+            Object_AllocTraits::deallocate(allocator, object, 1);
+            throw;
+        }
+        StatsHooks::blockCreated<T>(BlockKind::Split);
+    }
+
+    template <typename... Args>
+    void construct(Args&&... args) {
+        Object_AllocTraits::construct(allocator, object,
+                                      std::forward<Args>(args)...);
+    }
+
+    void construct(DefaultInit /*unused*/) {
+        new (static_cast<void*>(object)) T;
+    }
+
+    static void* manage(BaseControlBlock* base, ControlOp op,
+                        const void* key) {
+        auto* self = static_cast<SplitControlBlock*>(base);
+        if (op == ControlOp::GetDeleter) {
+            return nullptr;
+        }
+        if (op == ControlOp::GetObject) {
+            return objectIfKey(self->object, key);
+        }
+        StatsHooks::blockManaged<T>(op, sizeof(SplitControlBlock));
+        if (op != ControlOp::Deallocate) {
+            Object_AllocTraits::destroy(self->allocator, self->object);
+            Object_AllocTraits::deallocate(self->allocator, self->object, 1);
+        }
+        if (op != ControlOp::Destroy) {
+            SCB_Alloc SCB_allocator = self->allocator;
+            self->~SplitControlBlock();
+            SCB_AllocTraits::deallocate(SCB_allocator, self, 1);
+        }
+        return nullptr;
+    }
+};
+
+template <size_t Align>
+struct alignas(Align) StorageUnit {
+    char bytes[Align];
+};
+
+// The block is followed by size elements of T within the same allocation,
+// which is made of StorageUnit so that both the block and T are aligned.
+template <typename T, typename Alloc>
+struct MakeSharedArrayControlBlock : BaseControlBlock {
+    using MSACB = MakeSharedArrayControlBlock;
+    using Elem_Alloc =
+        typename std::allocator_traits<Alloc>::template rebind_alloc<T>;
+    using Elem_AllocTraits = std::allocator_traits<Elem_Alloc>;
+
+    // std::allocator does not customize construct and destroy, so the
+    // standard algorithms can skip the loops for trivial element types
+    static constexpr bool kPlainAllocator =
+        std::is_same_v<Elem_Alloc, std::allocator<T>>;
+
+    size_t size;
+    [[no_unique_address]] Alloc allocator;
+
+    MakeSharedArrayControlBlock(size_t size, const Alloc& allocator)
+        : BaseControlBlock(&manage), size(size), allocator(allocator) {}
+
+    static constexpr size_t kUnitSize =
+        std::max({alignof(BaseControlBlock), alignof(size_t), alignof(Alloc),
+                  alignof(T)});
+
+    static constexpr size_t elementsOffset() {
+        return (sizeof(MSACB) + alignof(T) - 1) / alignof(T) * alignof(T);
+    }
+    static size_t unitCount(size_t size) {
+        return (elementsOffset() + size * sizeof(T) + kUnitSize - 1) /
+               kUnitSize;
+    }
+
+    using Unit = StorageUnit<kUnitSize>;
+    using Unit_Alloc =
+        typename std::allocator_traits<Alloc>::template rebind_alloc<Unit>;
+    using Unit_AllocTraits = std::allocator_traits<Unit_Alloc>;
+
+    T* elements() {
+        return std::launder(
+            reinterpret_cast<T*>(reinterpret_cast<char*>(this) +
+                                 elementsOffset()));
+    }
+
+    template <typename... Args>
+    static MSACB* create(const Alloc& alloc, size_t size,
+                         const Args&... args) {
+        // unitCount would wrap around and allocate too little
+        if (size > (SIZE_MAX - elementsOffset() - kUnitSize) / sizeof(T)) {
+            throw std::bad_array_new_length();
+        }
+        Unit_Alloc unit_allocator = alloc;
+        Unit* memory = Unit_AllocTraits::allocate(unit_allocator,
+                                                  unitCount(size));
+        auto* block = new (memory) MSACB(size, alloc);
+        block->shared_count = 1;
+        block->weak_count = 1;
+        try {
+            block->constructElements(args...);
+        } catch (...) {
+            block->~MSACB();
+            Unit_AllocTraits::deallocate(unit_allocator, memory,
+                                         unitCount(size));
+            throw;
+        }
+        StatsHooks::blockCreated<T>(BlockKind::Array);
+        return block;
+    }
+
+    void constructElements(DefaultInit /*unused*/) {
+        std::uninitialized_default_construct_n(elements(), size);
+    }
+
+    template <typename... Args>
+    void constructElements(const Args&... args) {
+        T* first = elements();
+        if constexpr (kPlainAllocator && sizeof...(Args) == 0) {
+            std::uninitialized_value_construct_n(first, size);
+        } else if constexpr (kPlainAllocator) {
+            std::uninitialized_fill_n(first, size, args...);
+        } else {
+            Elem_Alloc elem_allocator = allocator;
+            size_t constructed = 0;
+            try {
+                for (; constructed < size; ++constructed) {
+                    Elem_AllocTraits::construct(elem_allocator,
+                                                first + constructed, args...);
+                }
+            } catch (...) {
+                destroyElements(constructed);
+                throw;
+            }
+        }
+    }
+
+    void destroyElements(size_t count) {
+        T* first = elements();
+        if constexpr (kPlainAllocator) {
+            std::destroy_n(first, count);
+        } else {
+            Elem_Alloc elem_allocator = allocator;
+            while (count > 0) {
+                --count;
+                Elem_AllocTraits::destroy(elem_allocator, first + count);
+            }
+        }
+    }
+
+    static void* manage(BaseControlBlock* base, ControlOp op,
+                        const void* /*unused*/) {
+        // arrays are not looked up by type
+        if (op == ControlOp::GetDeleter || op == ControlOp::GetObject) {
+            return nullptr;
+        }
+        auto* self = static_cast<MSACB*>(base);
+        StatsHooks::blockManaged<T>(op, unitCount(self->size) * kUnitSize);
+        if (op != ControlOp::Deallocate) {
+            self->destroyElements(self->size);
+        }
+        if (op != ControlOp::Destroy) {
+            Unit_Alloc unit_allocator = std::move(self->allocator);
+            size_t count = unitCount(self->size);
+            self->~MakeSharedArrayControlBlock();
+            Unit_AllocTraits::deallocate(unit_allocator,
+                                         reinterpret_cast<Unit*>(self), count);
+        }
+        return nullptr;
+    }
+};
+
+// One allocation holding a BatchSlab followed by size blocks, each with an
+// object and counts of its own. A block gives its part of the slab back
+// when its weak count drops, and the last one frees the slab.
+template <typename T, typename Alloc>
+struct BatchSlab;
+
+template <typename T, typename Alloc>
+struct BatchControlBlock : BaseControlBlock {
+    using Slab = BatchSlab<T, Alloc>;
+
+    Slab* slab;
+    alignas(T) char object[sizeof(T)];
+
+    explicit BatchControlBlock(Slab* slab)
+        : BaseControlBlock(&manage), slab(slab) {}
+
+    T* getObject() {
+        return std::launder(reinterpret_cast<T*>(object));
+    }
+
+    static void* manage(BaseControlBlock* base, ControlOp op,
+                        const void* key) {
+        auto* self = static_cast<BatchControlBlock*>(base);
+        if (op == ControlOp::GetDeleter) {
+            return nullptr;
+        }
+        if (op == ControlOp::GetObject) {
+            return objectIfKey(self->getObject(), key);
+        }
+        StatsHooks::blockManaged<T>(op, sizeof(BatchControlBlock));
+        Slab* slab = self->slab;
+        if (op != ControlOp::Deallocate) {
+            Slab::Object_AllocTraits::destroy(slab->allocator,
+                                              self->getObject());
+        }
+        if (op != ControlOp::Destroy) {
+            self->~BatchControlBlock();
+            slab->releaseBlock();
+        }
+        return nullptr;
+    }
+};
+
+template <typename T, typename Alloc>
+struct BatchSlab {
+    using Block = BatchControlBlock<T, Alloc>;
+    using Object_Alloc =
+        typename std::allocator_traits<Alloc>::template rebind_alloc<T>;
+    using Object_AllocTraits = std::allocator_traits<Object_Alloc>;
+
+    static constexpr size_t kUnitSize =
+        std::max({alignof(Block), alignof(CountingPolicy::Count),
+                  alignof(size_t), alignof(Object_Alloc)});
+
+    using Unit = StorageUnit<kUnitSize>;
+    using Unit_Alloc =
+        typename std::allocator_traits<Alloc>::template rebind_alloc<Unit>;
+    using Unit_AllocTraits = std::allocator_traits<Unit_Alloc>;
+
+    // blocks not yet given back
+    CountingPolicy::Count blocks{0};
+    size_t size;
+    [[no_unique_address]] Object_Alloc allocator;
+
+    BatchSlab(size_t size, const Alloc& allocator)
+        : size(size), allocator(allocator) {}
+
+    static constexpr size_t blocksOffset() {
+        return (sizeof(BatchSlab) + alignof(Block) - 1) / alignof(Block) *
+               alignof(Block);
+    }
+    static size_t unitCount(size_t size) {
+        return (blocksOffset() + size * sizeof(Block) + sizeof(Unit) - 1) /
+               sizeof(Unit);
+    }
+
+    Block* block(size_t index) {
+        return reinterpret_cast<Block*>(reinterpret_cast<char*>(this) +
+                                        blocksOffset()) +
+               index;
+    }
+
+    // Builds every object from args, or none of them. The blocks come back
+    // with one shared and one weak reference each.
+    template <typename... Args>
+    static BatchSlab* create(const Alloc& alloc, size_t size,
+                             const Args&... args) {
+        Unit_Alloc unit_allocator = alloc;
+        Unit* memory =
+            Unit_AllocTraits::allocate(unit_allocator, unitCount(size));
+        auto* slab = new (memory) BatchSlab(size, alloc);
+        size_t constructed = 0;
+        try {
+            for (; constructed < size; ++constructed) {
+                Block* next = new (slab->block(constructed)) Block(slab);
+                Object_AllocTraits::construct(slab->allocator,
+                                              next->getObject(), args...);
+            }
+        } catch (...) {
+            slab->block(constructed)->~Block();
+            while (constructed > 0) {
+                Block* built = slab->block(--constructed);
+                Object_AllocTraits::destroy(slab->allocator,
+                                            built->getObject());
+                built->~Block();
+            }
+            slab->~BatchSlab();
+            Unit_AllocTraits::deallocate(unit_allocator, memory,
+                                         unitCount(size));
+            throw;
+        }
+        CountingPolicy::increment(slab->blocks, static_cast<uint>(size));
+        for (size_t i = 0; i < size; ++i) {
+            slab->block(i)->shared_count = 1u;
+            slab->block(i)->weak_count = 1u;
+            StatsHooks::blockCreated<T>(BlockKind::Batch);
+        }
+        return slab;
+    }
+
+    void releaseBlock() {
+        if (!CountingPolicy::decrement(blocks)) {
+            return;
+        }
+        Unit_Alloc unit_allocator = std::move(allocator);
+        size_t count = unitCount(size);
+        this->~BatchSlab();
+        Unit_AllocTraits::deallocate(unit_allocator,
+                                     reinterpret_cast<Unit*>(this), count);
+    }
+};
+
+struct DestructionQueueStats {
+    uint64_t deferred = 0;
+    uint64_t reclaimed = 0;
+    uint64_t overflows = 0;
+    size_t pending = 0;
+    size_t high_water = 0;
+};
+
+// Destructions handed off by blocks of makeSharedDeferred. They run when the
+// owner calls drain() or on a worker thread started by startWorker(), which
+// needs SMART_POINTERS_THREAD_SAFE: the worker drops the last weak reference
+// of each block concurrently with its other users. The backlog is bounded:
+// once capacity entries are pending, further objects are destroyed inline by
+// the releasing thread and counted as overflows. The queue must outlive every
+// object deferred to it; its destructor stops the worker and drains what is
+// left.
+class DestructionQueue {
+  public:
+    using Reclaim = void (*)(BaseControlBlock*);
+
+    explicit DestructionQueue(size_t capacity)
+        : ring(std::max<size_t>(capacity, 1)) {}
+
+    DestructionQueue(const DestructionQueue&) = delete;
+    DestructionQueue& operator=(const DestructionQueue&) = delete;
+
+    ~DestructionQueue() {
+        stopWorker();
+        drain();
+    }
+
+    // returns false when the backlog is full; never allocates
+    bool push(BaseControlBlock* cb, Reclaim reclaim) {
+        {
+            std::lock_guard lock(mutex);
+            if (counters.pending == ring.size()) {
+                ++counters.overflows;
+                return false;
+            }
+            ring[(head + counters.pending) % ring.size()] = {cb, reclaim};
+            ++counters.pending;
+            ++counters.deferred;
+            counters.high_water =
+                std::max(counters.high_water, counters.pending);
+        }
+        ready.notify_one();
+        return true;
+    }
+
+    // runs up to max pending destructions on the calling thread
+    size_t drain(size_t max = SIZE_MAX) {
+        size_t done = 0;
+        Entry entry;
+        while (done < max && pop(entry)) {
+            entry.reclaim(entry.cb);
+            ++done;
+        }
+        return done;
+    }
+
+#ifdef SMART_POINTERS_THREAD_SAFE
+    void startWorker() {
+        std::lock_guard lock(mutex);
+        if (worker.joinable()) {
+            return;
+        }
+        stopping = false;
+        worker = std::thread([this] {
+            Entry entry;
+            while (waitAndPop(entry)) {
+                entry.reclaim(entry.cb);
+            }
+        });
+    }
+#endif
+
+    void stopWorker() {
+        {
+            std::lock_guard lock(mutex);
+            stopping = true;
+        }
+        ready.notify_all();
+        if (worker.joinable()) {
+            worker.join();
+        }
+    }
+
+    DestructionQueueStats stats() const {
+        std::lock_guard lock(mutex);
+        return counters;
+    }
+
+  private:
+    struct Entry {
+        BaseControlBlock* cb = nullptr;
+        Reclaim reclaim = nullptr;
+    };
+
+    std::vector<Entry> ring;
+    size_t head = 0;
+    DestructionQueueStats counters;
+    mutable std::mutex mutex;
+    std::condition_variable ready;
+    std::thread worker;
+    bool stopping = false;
+
+    bool popLocked(Entry& entry) {
+        if (counters.pending == 0) {
+            return false;
+        }
+        entry = ring[head];
+        head = (head + 1) % ring.size();
+        --counters.pending;
+        ++counters.reclaimed;
+        return true;
+    }
+
+    bool pop(Entry& entry) {
+        std::lock_guard lock(mutex);
+        return popLocked(entry);
+    }
+
+    // false once stopWorker() was called and nothing is pending
+    bool waitAndPop(Entry& entry) {
+        std::unique_lock lock(mutex);
+        ready.wait(lock, [this] {
+            return stopping || counters.pending != 0;
+        });
+        return popLocked(entry);
+    }
+};
+
+// Base for makeSharedDeferred blocks: it takes the place of the block's own
+// manager and sends the destruction of the object to a DestructionQueue. A
+// queued block holds one weak reference, so it stays allocated until the
+// queue has run the object's destructor.
+struct DeferredControlBlock : BaseControlBlock {
+    Manager inner;
+    DestructionQueue* queue = nullptr;
+
+    explicit DeferredControlBlock(Manager inner)
+        : BaseControlBlock(&manage), inner(inner) {}
+
+    static void* manage(BaseControlBlock* base, ControlOp op,
+                        const void* key) {
+        auto* self = static_cast<DeferredControlBlock*>(base);
+        if (op == ControlOp::Destroy) {
+            // releaseShared() drops the owners' weak reference right after
+            self->addWeak();
+        } else if (op != ControlOp::DestroyAndDeallocate) {
+            return self->inner(base, op, key);
+        }
+        if (!self->queue->push(self, &reclaim)) {
+            reclaim(self);
+        }
+        return nullptr;
+    }
+
+    static void reclaim(BaseControlBlock* base) {
+        auto* self = static_cast<DeferredControlBlock*>(base);
+        self->inner(base, ControlOp::Destroy, nullptr);
+        self->releaseWeak();
+    }
+};
+
+// Marks SharedPtr constructors that take over an already counted block.
+struct AdoptControlBlock {};
+
+struct BiasedControlBlock;
+
+// Biased blocks whose count went negative on a foreign thread and which the
+// owner thread has to merge. Shared by the owner and its blocks.
+struct BiasedMergeQueue {
+    std::mutex mutex;
+    std::vector<BiasedControlBlock*> blocks;
+    std::atomic<bool> pending{false};
+    bool orphaned = false;
+    std::atomic<uint> users{1};
+
+    void push(BiasedControlBlock* block);
+    void drain();
+    void abandon();
+
+    void addUser() {
+        users.fetch_add(1, std::memory_order_relaxed);
+    }
+    void releaseUser() {
+        if (users.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            delete this;
+        }
+    }
+};
+
+struct BiasedOwnerThread {
+    BiasedMergeQueue* queue = nullptr;
+
+    static BiasedOwnerThread& current() {
+        thread_local BiasedOwnerThread owner;
+        return owner;
+    }
+
+    BiasedMergeQueue* acquireQueue() {
+        if (queue == nullptr) {
+            queue = new BiasedMergeQueue();
+        }
+        return queue;
+    }
+
+    BiasedOwnerThread() = default;
+    BiasedOwnerThread(const BiasedOwnerThread&) = delete;
+    BiasedOwnerThread& operator=(const BiasedOwnerThread&) = delete;
+    ~BiasedOwnerThread() {
+        if (queue != nullptr) {
+            queue->abandon();
+            queue = nullptr;
+        }
+    }
+};
+
+// The owner thread counts its references in local_count with plain loads
+// and stores; every other thread uses the atomic shared_state, whose count
+// may go negative while references created by the owner die elsewhere.
+// The owner folds local_count into shared_state when it drops to zero or
+// when the block was queued to it, after which the block is unbiased.
+struct BiasedControlBlock : BaseControlBlock {
+    static constexpr int kMerged = 1;
+    static constexpr int kQueued = 2;
+    static constexpr int kCountStep = 4;
+
+    BiasedMergeQueue* queue;
+    std::atomic<uint> local_count{1};
+    std::atomic<int> shared_state{0};
+
+    explicit BiasedControlBlock(Manager manager)
+        : BaseControlBlock(manager),
+          queue(BiasedOwnerThread::current().acquireQueue()) {
+        count_mode = CountMode::Biased;
+        queue->addUser();
+    }
+    BiasedControlBlock(const BiasedControlBlock&) = delete;
+    BiasedControlBlock& operator=(const BiasedControlBlock&) = delete;
+    ~BiasedControlBlock() {
+        queue->releaseUser();
+    }
+
+    bool isOwner() const {
+        return BiasedOwnerThread::current().queue == queue &&
+               (shared_state.load(std::memory_order_relaxed) & kMerged) == 0;
+    }
+
+    void add() {
+        if (isOwner()) {
+            local_count.store(local_count.load(std::memory_order_relaxed) + 1,
+                              std::memory_order_relaxed);
+            return;
+        }
+        shared_state.fetch_add(kCountStep, std::memory_order_relaxed);
+    }
+
+    static int countOf(int state) {
+        return (state & ~(kMerged | kQueued)) / kCountStep;
+    }
+
+    // whether no reference is left to add to. Until the merge local_count
+    // is at least one, so only a negative shared count needs to read it;
+    // the owner writes local_count and so sees the exact total.
+    bool isDead(int state) const {
+        if ((state & kMerged) != 0) {
+            return countOf(state) == 0;
+        }
+        if (countOf(state) >= 0) {
+            return false;
+        }
+        int local =
+            static_cast<int>(local_count.load(std::memory_order_acquire));
+        return countOf(state) + local <= 0;
+    }
+
+    // fails once the total is zero, also while the block waits in the
+    // owner's queue with its object not yet destroyed
+    bool tryAdd() {
+        if (isOwner()) {
+            if (isDead(shared_state.load(std::memory_order_acquire))) {
+                return false;
+            }
+            add();
+            return true;
+        }
+        int state = shared_state.load(std::memory_order_relaxed);
+        do {
+            if (isDead(state)) {
+                return false;
+            }
+        } while (!shared_state.compare_exchange_weak(
+            state, state + kCountStep, std::memory_order_relaxed));
+        return true;
+    }
+
+    // returns true when the last reference is gone
+    bool release() {
+        if (isOwner()) {
+            uint local = local_count.load(std::memory_order_relaxed) - 1;
+            local_count.store(local, std::memory_order_relaxed);
+            bool last = local == 0 && mergeLocal() == kMerged;
+            // drain may release this block unless it is the last reference
+            BiasedMergeQueue* owner_queue = queue;
+            if (owner_queue->pending.load(std::memory_order_relaxed)) {
+                owner_queue->drain();
+            }
+            return last;
+        }
+        int state = shared_state.fetch_sub(kCountStep,
+                                           std::memory_order_release) -
+                    kCountStep;
+        if (state == kMerged) {
+            std::ignore = shared_state.load(std::memory_order_acquire);
+            return true;
+        }
+        if (state < 0 && (state & (kMerged | kQueued)) == 0 &&
+            (shared_state.fetch_or(kQueued, std::memory_order_relaxed) &
+             kQueued) == 0) {
+            queue->push(this);
+        }
+        return false;
+    }
+
+    uint count() const {
+        int state = shared_state.load(std::memory_order_relaxed);
+        int count = countOf(state);
+        if ((state & kMerged) == 0) {
+            count += static_cast<int>(
+                local_count.load(std::memory_order_relaxed));
+        }
+        return count < 0 ? 0 : static_cast<uint>(count);
+    }
+
+    // only on the owner thread, or on any thread once the owner exited
+    int mergeLocal() {
+        int local = static_cast<int>(
+                        local_count.load(std::memory_order_relaxed)) *
+                    kCountStep;
+        local_count.store(0, std::memory_order_relaxed);
+        return shared_state.fetch_add(local + kMerged,
+                                      std::memory_order_acq_rel) +
+               local + kMerged;
+    }
+
+    // whoever clears kQueued last on a dead block releases it
+    void mergeQueued() {
+        if ((shared_state.load(std::memory_order_relaxed) & kMerged) == 0) {
+            mergeLocal();
+        }
+        if ((shared_state.fetch_and(~kQueued, std::memory_order_acq_rel) &
+             ~kQueued) == kMerged) {
+            if (watched.load(std::memory_order_relaxed)) {
+                reportExpired();
+            }
+            destroy();
+            releaseWeak();
+        }
+    }
+};
+
+inline void BiasedMergeQueue::push(BiasedControlBlock* block) {
+    {
+        std::lock_guard lock(mutex);
+        if (!orphaned) {
+            blocks.push_back(block);
+            pending.store(true, std::memory_order_relaxed);
+            return;
+        }
+    }
+    block->mergeQueued();
+}
+
+inline void BiasedMergeQueue::drain() {
+    std::vector<BiasedControlBlock*> ready;
+    {
+        std::lock_guard lock(mutex);
+        ready.swap(blocks);
+        pending.store(false, std::memory_order_relaxed);
+    }
+    for (BiasedControlBlock* block : ready) {
+        block->mergeQueued();
+    }
+}
+
+inline void BiasedMergeQueue::abandon() {
+    {
+        std::lock_guard lock(mutex);
+        orphaned = true;
+    }
+    drain();
+    releaseUser();
+}
+
+#ifndef SMART_POINTERS_SHARD_COUNT
+#define SMART_POINTERS_SHARD_COUNT 8
+#endif
+
+inline constexpr uint kShardCount = SMART_POINTERS_SHARD_COUNT;
+
+// The shared count is split over kShardCount shards on cache lines of their
+// own. A reference is dropped on the shard it was taken on, so no shard goes
+// negative, and active counts the shards above zero: it is raised before a
+// shard leaves zero and lowered after one reaches it, so it only reads zero
+// once every shard does. Plain SharedPtrs count on shard 0 and
+// ShardedSharedPtr on the shard of its thread.
+struct ShardedControlBlock : BaseControlBlock {
+    struct alignas(kCacheLineSize) Shard {
+        std::atomic<uint> count{0};
+    };
+
+    std::atomic<uint> active{1};
+    Shard shards[kShardCount];
+
+    explicit ShardedControlBlock(Manager manager) : BaseControlBlock(manager) {
+        count_mode = CountMode::Sharded;
+        shards[0].count.store(1, std::memory_order_relaxed);
+    }
+
+    // threads are spread over the shards round-robin
+    static uint currentShard() {
+        static std::atomic<uint> next_shard{0};
+        thread_local uint shard =
+            next_shard.fetch_add(1, std::memory_order_relaxed) % kShardCount;
+        return shard;
+    }
+
+    // returns false if only_if_alive and the object is gone; otherwise the
+    // caller holds a reference already
+    bool add(uint shard, uint n, bool only_if_alive) {
+        std::atomic<uint>& count = shards[shard].count;
+        uint current = count.load(std::memory_order_relaxed);
+        while (current != 0) {
+            if (count.compare_exchange_weak(current, current + n,
+                                            std::memory_order_relaxed)) {
+                return true;
+            }
+        }
+        // reserve this shard's place in active before it leaves zero
+        if (only_if_alive) {
+            uint shards_active = active.load(std::memory_order_relaxed);
+            do {
+                if (shards_active == 0) {
+                    return false;
+                }
+            } while (!active.compare_exchange_weak(
+                shards_active, shards_active + 1, std::memory_order_acq_rel));
+        } else {
+            active.fetch_add(1, std::memory_order_acq_rel);
+        }
+        while (true) {
+            if (current == 0) {
+                if (count.compare_exchange_weak(current, n,
+                                                std::memory_order_release,
+                                                std::memory_order_relaxed)) {
+                    return true;
+                }
+            } else if (count.compare_exchange_weak(current, current + n,
+                                                   std::memory_order_relaxed)) {
+                // someone else moved the shard off zero first
+                active.fetch_sub(1, std::memory_order_relaxed);
+                return true;
+            }
+        }
+    }
+
+    // returns true when the last reference is gone
+    bool release(uint shard, uint n) {
+        if (shards[shard].count.fetch_sub(n, std::memory_order_acq_rel) != n) {
+            return false;
+        }
+        return active.fetch_sub(1, std::memory_order_acq_rel) == 1;
+    }
+
+    uint count() const {
+        uint total = 0;
+        for (const Shard& shard : shards) {
+            total += shard.count.load(std::memory_order_relaxed);
+        }
+        return total;
+    }
+};
+
+// The biased owner's updates are plain stores already, so batches are not
+// fused.
+void BaseControlBlock::addSharedSlow(uint n) {
+    if (count_mode == CountMode::Sharded) {
+        static_cast<ShardedControlBlock*>(this)->add(0, n, false);
+        return;
+    }
+    for (uint i = 0; i < n; ++i) {
+        static_cast<BiasedControlBlock*>(this)->add();
+    }
+}
+
+bool BaseControlBlock::tryAddSharedSlow() {
+    if (count_mode == CountMode::Sharded) {
+        return static_cast<ShardedControlBlock*>(this)->add(0, 1, true);
+    }
+    return static_cast<BiasedControlBlock*>(this)->tryAdd();
+}
+
+bool BaseControlBlock::releaseSharedSlow(uint n) {
+    if (count_mode == CountMode::Sharded) {
+        return static_cast<ShardedControlBlock*>(this)->release(0, n);
+    }
+    bool last = false;
+    for (uint i = 0; i < n; ++i) {
+        last = static_cast<BiasedControlBlock*>(this)->release();
+    }
+    return last;
+}
+
+uint BaseControlBlock::sharedCountSlow() const {
+    if (count_mode == CountMode::Sharded) {
+        return static_cast<const ShardedControlBlock*>(this)->count();
+    }
+    return static_cast<const BiasedControlBlock*>(this)->count();
+}
+
+// Hazard pointers: a reader publishes the address it is about to use in a
+// record of its own, and an object that is published somewhere is not freed
+// but parked until the last such reader lets go. Records are recycled and
+// never freed; each sits on its own cache line so readers do not share one.
+class HazardDomain {
+  public:
+    using Reclaimer = void (*)(void*);
+
+    struct alignas(kCacheLineSize) Record {
+        std::atomic<const void*> pointer{nullptr};
+        std::atomic<bool> active{false};
+        Record* next = nullptr;
+    };
+
+    static Record* acquire() {
+        thread_local Record* hint = nullptr;
+        if (hint != nullptr && tryActivate(hint)) {
+            return hint;
+        }
+        for (Record* record = head().load(std::memory_order_acquire);
+             record != nullptr; record = record->next) {
+            if (tryActivate(record)) {
+                hint = record;
+                return record;
+            }
+        }
+        auto* record = new Record;
+        record->active.store(true, std::memory_order_relaxed);
+        record->next = head().load(std::memory_order_relaxed);
+        while (!head().compare_exchange_weak(record->next, record,
+                                             std::memory_order_release,
+                                             std::memory_order_relaxed)) {
+        }
+        hint = record;
+        return record;
+    }
+
+    static void release(Record* record) {
+        record->pointer.store(nullptr);
+        record->active.store(false, std::memory_order_release);
+        // pairs with the store in retire(): one of the two sees the other
+        if (pending().load() != 0) {
+            reclaimParked();
+        }
+    }
+
+    // reclaims object now unless some record still publishes it
+    static void retire(void* object, Reclaimer reclaim) {
+        if (!isPublished(object)) {
+            reclaim(object);
+            return;
+        }
+        {
+            std::lock_guard lock(mutex());
+            parked().push_back({object, reclaim});
+            pending().store(parked().size());
+        }
+        // the reader may have let go before it could see the parked entry
+        reclaimParked();
+    }
+
+  private:
+    struct Parked {
+        void* object;
+        Reclaimer reclaim;
+    };
+
+    static std::atomic<Record*>& head() {
+        static std::atomic<Record*> records{nullptr};
+        return records;
+    }
+    static std::mutex& mutex() {
+        static std::mutex parked_mutex;
+        return parked_mutex;
+    }
+    static std::vector<Parked>& parked() {
+        static std::vector<Parked> objects;
+        return objects;
+    }
+    static std::atomic<size_t>& pending() {
+        static std::atomic<size_t> count{0};
+        return count;
+    }
+
+    static bool tryActivate(Record* record) {
+        bool expected = false;
+        return !record->active.load(std::memory_order_relaxed) &&
+               record->active.compare_exchange_strong(
+                   expected, true, std::memory_order_acquire,
+                   std::memory_order_relaxed);
+    }
+
+    static bool isPublished(const void* object) {
+        for (Record* record = head().load(std::memory_order_acquire);
+             record != nullptr; record = record->next) {
+            if (record->pointer.load() == object) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // reclaimers run outside the lock, since they may retire objects too
+    static void reclaimParked() {
+        std::vector<Parked> ready;
+        {
+            std::lock_guard lock(mutex());
+            auto still_published = std::partition(
+                parked().begin(), parked().end(), [](const Parked& entry) {
+                    return isPublished(entry.object);
+                });
+            ready.assign(still_published, parked().end());
+            parked().erase(still_published, parked().end());
+            pending().store(parked().size());
+        }
+        for (const Parked& entry : ready) {
+            entry.reclaim(entry.object);
+        }
+    }
+};
+
+// Every WeakPtrTable owns an inbox. Inserting a handle registers the inbox
+// with its block, and when a watched block's object dies the block is posted
+// only to the inboxes registered for it. Each post holds a weak reference so
+// the address cannot be reused before the table has swept it. Registrations
+// live in address-striped maps, so unrelated blocks rarely share a lock.
+struct ExpiryInbox {
+    std::mutex mutex;
+    std::vector<BaseControlBlock*> expired;
+    // touched by the owning table only: registered blocks, and how many of
+    // its entries hold each
+    std::unordered_map<BaseControlBlock*, size_t> watching;
+};
+
+class ExpiryLog {
+  public:
+    static void watch(BaseControlBlock* cb, ExpiryInbox* inbox) {
+        if (cb == nullptr || inbox->watching[cb]++ != 0) {
+            return;
+        }
+        Stripe& stripe = stripeOf(cb);
+        std::lock_guard lock(stripe.mutex);
+        stripe.watchers[cb].push_back(inbox);
+        cb->watched.store(true, std::memory_order_relaxed);
+    }
+
+    static void unwatch(BaseControlBlock* cb, ExpiryInbox* inbox) {
+        auto it = cb == nullptr ? inbox->watching.end()
+                                : inbox->watching.find(cb);
+        if (it == inbox->watching.end() || --it->second != 0) {
+            return;
+        }
+        inbox->watching.erase(it);
+        forget(cb, inbox);
+    }
+
+    static void unsubscribe(ExpiryInbox* inbox) {
+        for (const auto& registered : inbox->watching) {
+            forget(registered.first, inbox);
+        }
+        inbox->watching.clear();
+        // nothing can be posted any more
+        release(inbox->expired);
+        inbox->expired.clear();
+    }
+
+    // posts while holding the stripe, so an inbox that has forgotten the
+    // block is never written to afterwards
+    static void publish(BaseControlBlock* cb) {
+        Stripe& stripe = stripeOf(cb);
+        std::lock_guard lock(stripe.mutex);
+        auto it = stripe.watchers.find(cb);
+        if (it == stripe.watchers.end()) {
+            return;
+        }
+        for (ExpiryInbox* inbox : it->second) {
+            cb->addWeak();
+            std::lock_guard inbox_lock(inbox->mutex);
+            inbox->expired.push_back(cb);
+        }
+        stripe.erase(it);
+    }
+
+    static std::vector<BaseControlBlock*> take(ExpiryInbox* inbox) {
+        std::vector<BaseControlBlock*> expired;
+        {
+            std::lock_guard lock(inbox->mutex);
+            expired.swap(inbox->expired);
+        }
+        // dead blocks are no longer registered anywhere
+        for (BaseControlBlock* cb : expired) {
+            inbox->watching.erase(cb);
+        }
+        return expired;
+    }
+
+    static void release(const std::vector<BaseControlBlock*>& expired) {
+        for (BaseControlBlock* cb : expired) {
+            cb->releaseWeak();
+        }
+    }
+
+  private:
+    static constexpr size_t kStripes = 16;
+
+    struct Stripe {
+        std::mutex mutex;
+        std::unordered_map<BaseControlBlock*, std::vector<ExpiryInbox*>>
+            watchers;
+
+        void erase(decltype(watchers)::iterator it) {
+            watchers.erase(it);
+            if (watchers.empty()) {
+                // an idle stripe keeps no buckets
+                decltype(watchers)().swap(watchers);
+            }
+        }
+    };
+
+    static Stripe& stripeOf(BaseControlBlock* cb) {
+        static Stripe stripes[kStripes];
+        return stripes[(reinterpret_cast<uintptr_t>(cb) >> 4) % kStripes];
+    }
+
+    static void forget(BaseControlBlock* cb, ExpiryInbox* inbox) {
+        Stripe& stripe = stripeOf(cb);
+        std::lock_guard lock(stripe.mutex);
+        auto it = stripe.watchers.find(cb);
+        if (it == stripe.watchers.end()) {
+            return;
+        }
+        std::erase(it->second, inbox);
+        if (it->second.empty()) {
+            stripe.erase(it);
+        }
+    }
+};
+
+void BaseControlBlock::reportExpired() {
+    ExpiryLog::publish(this);
+}
+
+// Blocks whose last reference goes while another iterative object is being
+// destroyed on this thread wait here, and the outermost release destroys
+// them one after another. Chains are torn down in constant stack depth.
+struct IterativeReleases {
+    std::vector<BaseControlBlock*> pending;
+    bool draining = false;
+
+    static IterativeReleases& current() {
+        thread_local IterativeReleases releases;
+        return releases;
+    }
+};
+
+void BaseControlBlock::finishIteratively() {
+    IterativeReleases& releases = IterativeReleases::current();
+    if (releases.draining) {
+        releases.pending.push_back(this);
+        return;
+    }
+    releases.draining = true;
+    finishRelease();
+    while (!releases.pending.empty()) {
+        BaseControlBlock* next = releases.pending.back();
+        releases.pending.pop_back();
+        next->finishRelease();
+    }
+    releases.draining = false;
+}
+
+// References per control block over a window of handles, so that shareN()
+// and releaseN() touch every block once however its handles are interleaved.
+// The capacity is fixed to keep the batch calls allocation-free: add() turns
+// down the first block that does not fit, which ends the window.
+class BlockTally {
+  public:
+    static constexpr size_t kCapacity = 8;
+
+    bool add(BaseControlBlock* cb) {
+        if (cb == nullptr) {
+            return true;
+        }
+        for (size_t i = 0; i < size; ++i) {
+            if (entries[i].cb == cb) {
+                if (entries[i].count == UINT_MAX) {
+                    return false;
+                }
+                ++entries[i].count;
+                return true;
+            }
+        }
+        if (size == kCapacity) {
+            return false;
+        }
+        entries[size++] = {cb, 1};
+        return true;
+    }
+
+    void addShared() const {
+        for (size_t i = 0; i < size; ++i) {
+            entries[i].cb->addShared(entries[i].count);
+        }
+    }
+
+    void releaseShared() const {
+        for (size_t i = 0; i < size; ++i) {
+            entries[i].cb->releaseShared(entries[i].count);
+        }
+    }
+
+  private:
+    struct Entry {
+        BaseControlBlock* cb;
+        uint count;
+    };
+
+    Entry entries[kCapacity];
+    size_t size = 0;
+};
+
+}  // namespace detail
+
+using detail::BlockKind;
+using detail::ControlBlockPoolStats;
+using detail::DestructionQueue;
+using detail::DestructionQueueStats;
+using detail::SharedPtrSiteStats;
+using detail::SharedPtrStatsSite;
+using detail::SharedPtrStatsSnapshot;
+using detail::SharedPtrTypeStats;
+using detail::dumpSharedPtrStats;
+using detail::kCacheLineSize;
+using detail::kStatsEnabled;
+using detail::sharedPtrStats;
+
+template <typename T>
+class WeakPtr;
+
+template <typename T>
+class EnableSharedFromThis;
+
+template <typename T>
+class SharedPtr;
+
+template <typename T>
+class IntrusivePtr;
+
+template <typename T>
+class UniquePtr;
+
+template <typename T>
+class ShardedSharedPtr;
+
+template <typename Handle>
+class AtomicHandle;
+
+template <typename T>
+class EnableIntrusiveRefCount;
+
+// Marker base: when the last SharedPtr to such an object goes, the objects
+// its destructor releases are destroyed afterwards in a loop rather than
+// recursively, so long chains and deep trees cannot overflow the stack.
+struct EnableIterativeDestruction {};
+
+// Finds the EnableIntrusiveRefCount base of T, which may be a base of T.
+template <typename T>
+EnableIntrusiveRefCount<T>* intrusiveBaseOf(
+    const EnableIntrusiveRefCount<T>* object) {
+    return const_cast<EnableIntrusiveRefCount<T>*>(object);
+}
+
+template <typename T>
+concept IntrusivelyCounted = requires(T* object) { intrusiveBaseOf(object); };
+
+template <typename T, typename Base, size_t Align = alignof(T),
+          typename Alloc, typename... Args>
+SharedPtr<T> allocateSharedWithBase(const Alloc& alloc, Args&&... args);
+
+template <typename T, typename Alloc, typename... Args>
+SharedPtr<T> allocateSharedSplit(const Alloc& alloc, Args&&... args);
+
+template <typename Delete, typename T>
+Delete* getDeleter(const SharedPtr<T>& shp);
+
+template <typename T, typename Alloc, typename... Args>
+std::vector<SharedPtr<T>> allocateSharedBatch(const Alloc& alloc, size_t size,
+                                              const Args&... args);
+
+template <typename T, typename U>
+SharedPtr<T> sharedCast(const SharedPtr<U>& shp);
+
+template <typename T, typename U>
+SharedPtr<T> sharedCast(SharedPtr<U>&& shp);
+
+template <typename T, typename Alloc, typename... Args>
+SharedPtr<T> allocateSharedDeferred(const Alloc& alloc,
+                                    DestructionQueue& queue, Args&&... args);
+
+template <typename T, typename Alloc, typename... Args>
+UniquePtr<T> allocateUniqueShareable(const Alloc& alloc, Args&&... args);
+
+template <typename ForwardIt, typename OutputIt>
+OutputIt shareN(ForwardIt first, size_t count, OutputIt out);
+
+template <typename ForwardIt>
+void releaseN(ForwardIt first, size_t count);
+
+template <typename T>
+class SharedPtr {
+  public:
+    using element_type = std::remove_extent_t<T>;
+
+  private:
+    element_type* ptr = nullptr;
+    detail::BaseControlBlock* cb = nullptr;
+
+    // arrays owned through a raw pointer are released with delete[]
+    template <typename U>
+    using DefaultDelete =
+        std::default_delete<std::conditional_t<std::is_array_v<T>, U[], U>>;
+
+    SharedPtr(const WeakPtr<T>& wp) noexcept {
+        bool locked = wp.cb != nullptr && wp.cb->tryAddShared();
+        detail::StatsHooks::locked(locked);
+        if (locked) {
+            detail::StatsHooks::sharedAdded(1);
+            ptr = wp.ptr;
+            cb = wp.cb;
+        }
+    }
+
+    // the deleter is forwarded into the block, and other_ptr is deleted by
+    // the caller's deleter if that cannot be done
+    template <typename U, typename D, typename A>
+    void initControlBlock(U* other_ptr, D&& deleter, A&& allocator) {
+        try {
+            tryInitControlBlock(other_ptr, std::forward<D>(deleter),
+                                std::forward<A>(allocator));
+        } catch (...) {
+            deleter(other_ptr);
+            throw;
+        }
+    }
+
+    // like initControlBlock, but a failure leaves other_ptr to the caller
+    template <typename U, typename D, typename A>
+    void tryInitControlBlock(U* other_ptr, D&& deleter, A&& allocator) {
+        using RCB = detail::RegularControlBlock<U, std::decay_t<D>,
+                                                std::decay_t<A>>;
+        using RCB_Alloc = typename RCB::RCB_Alloc;
+        using RCB_AllocTraits = std::allocator_traits<RCB_Alloc>;
+
+        RCB_Alloc RCB_allocator(std::forward<A>(allocator));
+        RCB* RCB_ptr = RCB_AllocTraits::allocate(RCB_allocator, 1);
+        // deleter must stay whole until the block is complete, so that a
+        // failure can still dispose of other_ptr: it is moved only when
+        // nothing after the move can throw, and copied otherwise. A deleter
+        // that cannot be copied is moved regardless; its move must not
+        // throw, as for std::unique_ptr.
+        constexpr bool kMove =
+            std::is_nothrow_constructible_v<RCB, U*, D, RCB_Alloc> ||
+            !std::is_copy_constructible_v<std::decay_t<D>>;
+        try {
+            if constexpr (kMove) {
+                detail::StatsHooks::blockCreated<U>(BlockKind::RawPointer);
+                new (RCB_ptr) RCB(other_ptr, std::forward<D>(deleter),
+                                  std::move(RCB_allocator));
+            } else {
+                new (RCB_ptr) RCB(other_ptr, std::as_const(deleter),
+                                  std::as_const(RCB_allocator));
+                try {
+                    detail::StatsHooks::blockCreated<U>(BlockKind::RawPointer);
+                } catch (...) {
+                    RCB_ptr->~RCB();
+                    throw;
+                }
+            }
+        } catch (...) {
+            RCB_AllocTraits::deallocate(RCB_allocator, RCB_ptr, 1);
+            throw;
+        }
+        RCB_ptr->shared_count = 1;
+        RCB_ptr->weak_count = 1;
+        ptr = other_ptr;
+        cb = RCB_ptr;
+        attachToObject(other_ptr);
+    }
+
+    // lets the object find its owner block from inside
+    template <typename U>
+    void attachToObject(U* object) {
+        attachSharedFromThis(object);
+        attachCounting(object, cb);
+    }
+
+    template <typename U>
+    void attachSharedFromThis(U* object) {
+        if constexpr (std::is_base_of_v<EnableSharedFromThis<U>, U>) {
+            object->enable_wp = *this;
+        }
+    }
+
+    // what a UniquePtr needs already: intrusive references count through
+    // block, and so does the teardown of iterative objects
+    template <typename U>
+    static void attachCounting(U* object, detail::BaseControlBlock* block) {
+        if constexpr (IntrusivelyCounted<U>) {
+            intrusiveBaseOf(object)->intrusive_owner = block;
+        }
+        if constexpr (std::is_base_of_v<EnableIterativeDestruction, U>) {
+            block->iterative = true;
+        }
+    }
+
+  public:
+    SharedPtr() noexcept {}
+
+    SharedPtr(detail::AdoptControlBlock /*unused*/, element_type* other_ptr,
+              detail::BaseControlBlock* other_cb) noexcept
+        : ptr(other_ptr), cb(other_cb) {}
+
+    SharedPtr(const SharedPtr& shp) noexcept : ptr(shp.ptr), cb(shp.cb) {
+        if (cb != nullptr) {
+            cb->addShared();
+        }
+    }
+
+    SharedPtr(SharedPtr&& shp) noexcept : ptr(shp.ptr), cb(shp.cb) {
+        shp.cb = nullptr;
+        shp.ptr = nullptr;
+    }
+
+    SharedPtr& operator=(const SharedPtr& shp) noexcept {
+        if (this == &shp) {
+            return *this;
+        }
+        SharedPtr copy(shp);
+        swap(copy);
+        return *this;
+    }
+
+    // takes over shp first, so releasing the old object cannot reach it
+    SharedPtr& operator=(SharedPtr&& shp) noexcept {
+        if (this == &shp) {
+            return *this;
+        }
+        detail::BaseControlBlock* old_cb = cb;
+        ptr = shp.ptr;
+        cb = shp.cb;
+        shp.ptr = nullptr;
+        shp.cb = nullptr;
+        if (old_cb != nullptr) {
+            old_cb->releaseShared();
+        }
+        return *this;
+    }
+
+    ~SharedPtr() {
+        if (cb != nullptr) {
+            cb->releaseShared();
+        }
+    }
+
+    template <typename U>
+    SharedPtr(const SharedPtr<U>& shp) noexcept : ptr(shp.ptr), cb(shp.cb) {
+        if (cb != nullptr) {
+            cb->addShared();
+        }
+    }
+
+    template <typename U>
+    SharedPtr(SharedPtr<U>&& shp) noexcept : ptr(shp.ptr), cb(shp.cb) {
+        shp.cb = nullptr;
+        shp.ptr = nullptr;
+    }
+
+    // aliasing: shares ownership with shp but points to other_ptr, usually
+    // a member of the object shp owns
+    template <typename U>
+    SharedPtr(const SharedPtr<U>& shp, element_type* other_ptr) noexcept
+        : ptr(other_ptr), cb(shp.cb) {
+        if (cb != nullptr) {
+            cb->addShared();
+        }
+    }
+
+    template <typename U>
+    SharedPtr(SharedPtr<U>&& shp, element_type* other_ptr) noexcept
+        : ptr(other_ptr), cb(shp.cb) {
+        shp.cb = nullptr;
+        shp.ptr = nullptr;
+    }
+
+    template <typename U>
+    SharedPtr& operator=(const SharedPtr<U>& shp) noexcept {
+        SharedPtr copy(shp);
+        swap(copy);
+        return *this;
+    }
+
+    template <typename U>
+    SharedPtr& operator=(SharedPtr<U>&& shp) noexcept {
+        SharedPtr copy(std::move(shp));
+        swap(copy);
+        return *this;
+    }
+
+    template <typename U>
+    SharedPtr(U* other_ptr) {
+        initControlBlock(other_ptr, DefaultDelete<U>(),
+                         detail::PoolAllocator<U>());
+    }
+
+    template <typename U, typename Delete>
+    SharedPtr(U* other_ptr, Delete&& deleter) {
+        initControlBlock(other_ptr, std::forward<Delete>(deleter),
+                         detail::PoolAllocator<U>());
+    }
+
+    template <typename U, typename Delete, typename Alloc>
+    SharedPtr(U* other_ptr, Delete&& deleter, Alloc&& allocator) {
+        initControlBlock(other_ptr, std::forward<Delete>(deleter),
+                         std::forward<Alloc>(allocator));
+    }
+
+    // The deleter is moved into the new block, or referenced there when D
+    // is a reference. If the block cannot be made, up keeps the object.
+    template <typename U, typename D>
+    SharedPtr(std::unique_ptr<U, D>&& up) {
+        using Element = std::remove_extent_t<U>;
+        Element* other_ptr = up.get();
+        if (other_ptr == nullptr) {
+            return;
+        }
+        if constexpr (std::is_reference_v<D>) {
+            tryInitControlBlock(other_ptr, std::ref(up.get_deleter()),
+                                detail::PoolAllocator<Element>());
+        } else {
+            tryInitControlBlock(other_ptr, std::move(up.get_deleter()),
+                                detail::PoolAllocator<Element>());
+        }
+        up.release();
+    }
+
+    // takes over the block makeUniqueShareable reserved, counters included;
+    // the block wires the object as the type it was made as, see
+    // PromotionHooks
+    template <typename U>
+    SharedPtr(UniquePtr<U>&& up) noexcept {
+        ptr = std::exchange(up.ptr, nullptr);
+        cb = std::exchange(up.cb, nullptr);
+        if (cb != nullptr) {
+            cb->manager(cb, detail::ControlOp::Promote, nullptr);
+        }
+    }
+
+    uint use_count() const noexcept {
+        return cb == nullptr ? 0 : cb->sharedCount();
+    }
+
+    void reset() noexcept {
+        SharedPtr().swap(*this);
+    }
+    template <typename U>
+    void reset(U* other_ptr) {
+        SharedPtr<T>(other_ptr).swap(*this);
+    }
+
+    void swap(SharedPtr& shp) noexcept {
+        std::swap(cb, shp.cb);
+        std::swap(ptr, shp.ptr);
+    }
+
+    // owner-based queries compare control blocks, never the counts
+    template <typename U>
+    bool ownerBefore(const SharedPtr<U>& shp) const noexcept {
+        return std::less<detail::BaseControlBlock*>()(cb, shp.cb);
+    }
+    template <typename U>
+    bool ownerBefore(const WeakPtr<U>& wp) const noexcept {
+        return std::less<detail::BaseControlBlock*>()(cb, wp.cb);
+    }
+    template <typename U>
+    bool ownerEqual(const SharedPtr<U>& shp) const noexcept {
+        return cb == shp.cb;
+    }
+    template <typename U>
+    bool ownerEqual(const WeakPtr<U>& wp) const noexcept {
+        return cb == wp.cb;
+    }
+    size_t ownerHash() const noexcept {
+        return std::hash<detail::BaseControlBlock*>()(cb);
+    }
+
+    // void for SharedPtr<void>, which has no object to dereference
+    std::add_lvalue_reference_t<element_type> operator*() const {
+        return *ptr;
+    }
+
+    element_type* operator->() const {
+        return ptr;
+    }
+
+    std::add_lvalue_reference_t<element_type> operator[](
+        ptrdiff_t index) const {
+        return ptr[index];
+    }
+
+    element_type* get() const {
+        return ptr;
+    }
+
+    template <typename U, typename Base, size_t Align, typename Alloc,
+              typename... Args>
+    friend SharedPtr<U> allocateSharedWithBase(const Alloc&, Args&&...);
+
+    template <typename U, typename Alloc, typename... Args>
+    friend SharedPtr<U> allocateSharedSplit(const Alloc&, Args&&...);
+
+    template <typename Delete, typename U>
+    friend Delete* getDeleter(const SharedPtr<U>&);
+
+    template <typename U, typename Alloc, typename... Args>
+    friend std::vector<SharedPtr<U>> allocateSharedBatch(const Alloc&, size_t,
+                                                         const Args&...);
+
+    template <typename U, typename V>
+    friend SharedPtr<U> sharedCast(const SharedPtr<V>&);
+
+    template <typename U, typename V>
+    friend SharedPtr<U> sharedCast(SharedPtr<V>&&);
+
+    template <typename U, typename Alloc, typename... Args>
+    friend SharedPtr<U> allocateSharedDeferred(const Alloc&,
+                                               DestructionQueue&, Args&&...);
+
+    template <typename U, typename Alloc, typename... Args>
+    friend UniquePtr<U> allocateUniqueShareable(const Alloc&, Args&&...);
+
+    friend detail::PromotionHooks;
+
+    template <typename ForwardIt, typename OutputIt>
+    friend OutputIt shareN(ForwardIt, size_t, OutputIt);
+
+    template <typename ForwardIt>
+    friend void releaseN(ForwardIt, size_t);
+
+    template <typename U>
+    friend class WeakPtr;
+
+    template <typename U>
+    friend class SharedPtr;
+
+    template <typename Handle>
+    friend class AtomicHandle;
+
+    template <typename U>
+    friend class CompactSharedPtr;
+    template <typename K, typename U>
+    friend class WeakPtrTable;
+
+    template <typename U>
+    friend class IntrusivePtr;
+
+    template <typename U>
+    friend class ShardedSharedPtr;
+};
+
+template <typename T>
+void detail::PromotionHooks::promoted(T* object, BaseControlBlock* block) {
+    SharedPtr<T> owner(detail::AdoptControlBlock(), object, block);
+    owner.attachSharedFromThis(object);
+    // the reference belongs to the SharedPtr being promoted
+    owner.cb = nullptr;
+}
+
+// Handle for objects that every thread copies all the time, made by
+// makeSharedSharded. Copies count on the shard of the copying thread and
+// remember it, so they may be released anywhere. It converts to and from
+// SharedPtr and WeakPtr; on blocks that are not sharded it counts like a
+// SharedPtr. Only available with SMART_POINTERS_THREAD_SAFE.
+template <typename T>
+class ShardedSharedPtr {
+    static_assert(!std::is_array_v<T>, "arrays are not supported");
+    static_assert(detail::kThreadSafeCounting<T>,
+                  "ShardedSharedPtr needs SMART_POINTERS_THREAD_SAFE");
+
+  private:
+    T* ptr = nullptr;
+    detail::BaseControlBlock* cb = nullptr;
+    uint shard = 0;
+
+    detail::ShardedControlBlock* sharded() const {
+        return cb != nullptr && cb->count_mode == detail::CountMode::Sharded
+                   ? static_cast<detail::ShardedControlBlock*>(cb)
+                   : nullptr;
+    }
+
+    // the caller holds another reference to the block
+    void acquire() {
+        if (cb == nullptr) {
+            return;
+        }
+        if (detail::ShardedControlBlock* block = sharded()) {
+            detail::StatsHooks::sharedAdded(1);
+            shard = detail::ShardedControlBlock::currentShard();
+            block->add(shard, 1, false);
+            return;
+        }
+        cb->addShared();
+    }
+
+    void release() {
+        if (cb == nullptr) {
+            return;
+        }
+        if (detail::ShardedControlBlock* block = sharded()) {
+            detail::StatsHooks::sharedReleased(1);
+            if (block->release(shard, 1)) {
+                cb->releasedLast();
+            }
+            return;
+        }
+        cb->releaseShared();
+    }
+
+  public:
+    ShardedSharedPtr() noexcept {}
+
+    explicit ShardedSharedPtr(const SharedPtr<T>& shp) noexcept
+        : ptr(shp.ptr), cb(shp.cb) {
+        acquire();
+    }
+
+    // a SharedPtr's reference sits on shard 0, and stays there
+    explicit ShardedSharedPtr(SharedPtr<T>&& shp) noexcept
+        : ptr(std::exchange(shp.ptr, nullptr)),
+          cb(std::exchange(shp.cb, nullptr)) {}
+
+    // empty if wp has expired
+    explicit ShardedSharedPtr(const WeakPtr<T>& wp) noexcept {
+        bool locked = false;
+        if (wp.cb != nullptr &&
+            wp.cb->count_mode == detail::CountMode::Sharded) {
+            shard = detail::ShardedControlBlock::currentShard();
+            locked = static_cast<detail::ShardedControlBlock*>(wp.cb)->add(
+                shard, 1, true);
+        } else if (wp.cb != nullptr) {
+            locked = wp.cb->tryAddShared();
+        }
+        detail::StatsHooks::locked(locked);
+        if (locked) {
+            detail::StatsHooks::sharedAdded(1);
+            ptr = wp.ptr;
+            cb = wp.cb;
+        }
+    }
+
+    ShardedSharedPtr(const ShardedSharedPtr& ssp) noexcept
+        : ptr(ssp.ptr), cb(ssp.cb) {
+        acquire();
+    }
+
+    ShardedSharedPtr(ShardedSharedPtr&& ssp) noexcept
+        : ptr(std::exchange(ssp.ptr, nullptr)),
+          cb(std::exchange(ssp.cb, nullptr)),
+          shard(ssp.shard) {}
+
+    ShardedSharedPtr& operator=(const ShardedSharedPtr& ssp) noexcept {
+        ShardedSharedPtr copy(ssp);
+        swap(copy);
+        return *this;
+    }
+
+    ShardedSharedPtr& operator=(ShardedSharedPtr&& ssp) noexcept {
+        ShardedSharedPtr moved(std::move(ssp));
+        swap(moved);
+        return *this;
+    }
+
+    ~ShardedSharedPtr() {
+        release();
+    }
+
+    operator SharedPtr<T>() const {
+        if (cb != nullptr) {
+            cb->addShared();
+        }
+        return SharedPtr<T>(detail::AdoptControlBlock(), ptr, cb);
+    }
+
+    uint use_count() const noexcept {
+        return cb == nullptr ? 0 : cb->sharedCount();
+    }
+
+    void reset() noexcept {
+        ShardedSharedPtr().swap(*this);
+    }
+
+    void swap(ShardedSharedPtr& ssp) noexcept {
+        std::swap(cb, ssp.cb);
+        std::swap(ptr, ssp.ptr);
+        std::swap(shard, ssp.shard);
+    }
+
+    T& operator*() const {
+        return *ptr;
+    }
+
+    T* operator->() const {
+        return ptr;
+    }
+
+    T* get() const noexcept {
+        return ptr;
+    }
+
+    template <typename U>
+    friend class WeakPtr;
+};
+
+// Sole owner of an object made by makeUniqueShareable. The object already
+// sits in a fused block whose counters read one owner, so moving the
+// UniquePtr into a SharedPtr neither allocates nor updates a counter.
+template <typename T>
+class UniquePtr {
+    static_assert(!std::is_array_v<T>, "arrays are not supported");
+
+  private:
+    T* ptr = nullptr;
+    detail::BaseControlBlock* cb = nullptr;
+
+    UniquePtr(T* other_ptr, detail::BaseControlBlock* other_cb) noexcept
+        : ptr(other_ptr), cb(other_cb) {}
+
+  public:
+    UniquePtr() noexcept {}
+
+    UniquePtr(const UniquePtr&) = delete;
+    UniquePtr& operator=(const UniquePtr&) = delete;
+
+    UniquePtr(UniquePtr&& up) noexcept
+        : ptr(std::exchange(up.ptr, nullptr)),
+          cb(std::exchange(up.cb, nullptr)) {}
+
+    template <typename U>
+    UniquePtr(UniquePtr<U>&& up) noexcept
+        : ptr(std::exchange(up.ptr, nullptr)),
+          cb(std::exchange(up.cb, nullptr)) {}
+
+    UniquePtr& operator=(UniquePtr&& up) noexcept {
+        UniquePtr moved(std::move(up));
+        swap(moved);
+        return *this;
+    }
+
+    ~UniquePtr() {
+        reset();
+    }
+
+    void reset() noexcept {
+        if (cb != nullptr) {
+            ptr = nullptr;
+            std::exchange(cb, nullptr)->releaseShared();
+        }
+    }
+
+    void swap(UniquePtr& up) noexcept {
+        std::swap(cb, up.cb);
+        std::swap(ptr, up.ptr);
+    }
+
+    T& operator*() const {
+        return *ptr;
+    }
+
+    T* operator->() const {
+        return ptr;
+    }
+
+    T* get() const noexcept {
+        return ptr;
+    }
+
+    template <typename U, typename Alloc, typename... Args>
+    friend UniquePtr<U> allocateUniqueShareable(const Alloc&, Args&&...);
+
+    template <typename U>
+    friend class UniquePtr;
+
+    template <typename U>
+    friend class SharedPtr;
+};
+
+template <typename T>
+class WeakPtr {
+  private:
+    std::remove_extent_t<T>* ptr = nullptr;
+    detail::BaseControlBlock* cb = nullptr;
+
+  public:
+    WeakPtr() noexcept {}
+
+    template <typename U>
+    WeakPtr(const SharedPtr<U>& shp) noexcept : ptr(shp.ptr), cb(shp.cb) {
+        if (cb != nullptr) {
+            cb->addWeak();
+        }
+    }
+
+    template <typename U>
+    WeakPtr(const ShardedSharedPtr<U>& ssp) noexcept
+        : ptr(ssp.ptr), cb(ssp.cb) {
+        if (cb != nullptr) {
+            cb->addWeak();
+        }
+    }
+
+    WeakPtr(const WeakPtr& wp) noexcept : ptr(wp.ptr), cb(wp.cb) {
+        if (cb != nullptr) {
+            cb->addWeak();
+        }
+    }
+
+    WeakPtr(WeakPtr&& wp) noexcept : ptr(wp.ptr), cb(wp.cb) {
+        wp.ptr = nullptr;
+        wp.cb = nullptr;
+    }
+
+    WeakPtr& operator=(const WeakPtr& wp) noexcept {
+        WeakPtr copy(wp);
+        swap(copy);
+        return *this;
+    }
+
+    WeakPtr& operator=(WeakPtr&& wp) noexcept {
+        if (this == &wp) {
+            return *this;
+        }
+        detail::BaseControlBlock* old_cb = cb;
+        ptr = wp.ptr;
+        cb = wp.cb;
+        wp.ptr = nullptr;
+        wp.cb = nullptr;
+        if (old_cb != nullptr) {
+            old_cb->releaseWeak();
+        }
+        return *this;
+    }
+
+    ~WeakPtr() {
+        if (cb == nullptr) {
+            return;
+        }
+        cb->releaseWeak();
+    }
+
+    void swap(WeakPtr& wp) noexcept {
+        std::swap(ptr, wp.ptr);
+        std::swap(cb, wp.cb);
+    }
+
+    void reset() noexcept {
+        WeakPtr().swap(*this);
+    }
+
+    template <typename U>
+    WeakPtr(const WeakPtr<U>& wp) noexcept : ptr(wp.ptr), cb(wp.cb) {
+        if (cb != nullptr) {
+            cb->addWeak();
+        }
+    }
+
+    template <typename U>
+    WeakPtr(WeakPtr<U>&& wp) noexcept : ptr(wp.ptr), cb(wp.cb) {
+        wp.ptr = nullptr;
+        wp.cb = nullptr;
+    }
+
+    template <typename U>
+    WeakPtr& operator=(const WeakPtr<U>& wp) noexcept {
+        WeakPtr copy(wp);
+        swap(copy);
+        return *this;
+    }
+
+    template <typename U>
+    WeakPtr& operator=(WeakPtr<U>&& wp) noexcept {
+        WeakPtr copy(std::move(wp));
+        swap(copy);
+        return *this;
+    }
+
+    template <typename U>
+    WeakPtr& operator=(const SharedPtr<U>& shp) noexcept {
+        WeakPtr copy(shp);
+        swap(copy);
+        return *this;
+    }
+
+    bool expired() const noexcept {
+        return cb == nullptr || cb->sharedCount() == 0;
+    }
+
+    SharedPtr<T> lock() const noexcept {
+        return SharedPtr<T>(*this);
+    }
+
+    uint use_count() const noexcept {
+        return cb == nullptr ? 0 : cb->sharedCount();
+    }
+
+    template <typename U>
+    bool ownerBefore(const SharedPtr<U>& shp) const noexcept {
+        return std::less<detail::BaseControlBlock*>()(cb, shp.cb);
+    }
+    template <typename U>
+    bool ownerBefore(const WeakPtr<U>& wp) const noexcept {
+        return std::less<detail::BaseControlBlock*>()(cb, wp.cb);
+    }
+    template <typename U>
+    bool ownerEqual(const SharedPtr<U>& shp) const noexcept {
+        return cb == shp.cb;
+    }
+    template <typename U>
+    bool ownerEqual(const WeakPtr<U>& wp) const noexcept {
+        return cb == wp.cb;
+    }
+    size_t ownerHash() const noexcept {
+        return std::hash<detail::BaseControlBlock*>()(cb);
+    }
+
+    template <typename U>
+    friend class SharedPtr;
+
+    template <typename U>
+    friend class WeakPtr;
+
+    template <typename Handle>
+    friend class AtomicHandle;
+
+    template <typename K, typename U>
+    friend class WeakPtrTable;
+
+    template <typename U>
+    friend class ShardedSharedPtr;
+};
+
+// Move-only owner for async code. It holds the one shared reference taken
+// when it is made, see EnableSharedFromThis::keepAlive(), and moves
+// through continuations, coroutine frames and executor queues without
+// touching the count.
+template <typename T>
+class KeepAlive {
+  private:
+    SharedPtr<T> owner;
+
+  public:
+    KeepAlive() noexcept {}
+
+    explicit KeepAlive(SharedPtr<T>&& shp) noexcept : owner(std::move(shp)) {}
+
+    KeepAlive(const KeepAlive&) = delete;
+    KeepAlive& operator=(const KeepAlive&) = delete;
+
+    KeepAlive(KeepAlive&& ka) noexcept = default;
+    KeepAlive& operator=(KeepAlive&& ka) noexcept = default;
+
+    ~KeepAlive() = default;
+
+    // another owner, for the price of an increment
+    SharedPtr<T> share() const noexcept {
+        return owner;
+    }
+
+    // hands the reference over
+    SharedPtr<T> release() && noexcept {
+        return std::move(owner);
+    }
+
+    void reset() noexcept {
+        owner.reset();
+    }
+
+    T& operator*() const {
+        return *owner;
+    }
+
+    T* operator->() const {
+        return owner.get();
+    }
+
+    T* get() const noexcept {
+        return owner.get();
+    }
+};
+
+template <typename T>
+bool operator==(const KeepAlive<T>& lhs, std::nullptr_t /*unused*/) noexcept {
+    return lhs.get() == nullptr;
+}
+
+template <typename T>
+class EnableSharedFromThis {
+  private:
+    WeakPtr<T> enable_wp;
+
+  protected:
+    EnableSharedFromThis() noexcept = default;
+    // ownership belongs to an object, not to its value
+    EnableSharedFromThis(const EnableSharedFromThis& /*unused*/) noexcept {}
+    EnableSharedFromThis& operator=(
+        const EnableSharedFromThis& /*unused*/) noexcept {
+        return *this;
+    }
+    ~EnableSharedFromThis() = default;
+
+  public:
+    // all three are empty unless a SharedPtr owns the object; unlike
+    // std::enable_shared_from_this, shared_from_this() never throws
+    SharedPtr<T> shared_from_this() const noexcept {
+        return enable_wp.lock();
+    }
+
+    // one increment now and none while the token moves around
+    KeepAlive<T> keepAlive() const noexcept {
+        return KeepAlive<T>(enable_wp.lock());
+    }
+
+    // touches the weak count only
+    WeakPtr<T> weakFromThis() const noexcept {
+        return enable_wp;
+    }
+
+    template <typename U>
+    friend class SharedPtr;
+};
+
+// Keeps the reference count inside the object, so IntrusivePtr<T> is a single
+// pointer. Objects created by makeShared or SharedPtr(U*) instead forward
+// all intrusive counting to their control block, which keeps both kinds of
+// handles valid.
+template <typename T>
+class EnableIntrusiveRefCount {
+  private:
+    mutable detail::CountingPolicy::Count intrusive_count{0};
+    detail::BaseControlBlock* intrusive_owner = nullptr;
+
+    void addIntrusiveRef() const {
+        if (intrusive_owner != nullptr) {
+            intrusive_owner->addShared();
+        } else {
+            detail::CountingPolicy::increment(intrusive_count);
+        }
+    }
+
+    // returns true when the caller has to delete the object
+    bool releaseIntrusiveRef() const {
+        if (intrusive_owner != nullptr) {
+            intrusive_owner->releaseShared();
+            return false;
+        }
+        return detail::CountingPolicy::decrement(intrusive_count);
+    }
+
+    uint intrusiveCount() const {
+        return intrusive_owner != nullptr
+                   ? intrusive_owner->sharedCount()
+                   : detail::CountingPolicy::load(intrusive_count);
+    }
+
+  protected:
+    EnableIntrusiveRefCount() = default;
+    // references belong to an object, not to its value
+    EnableIntrusiveRefCount(const EnableIntrusiveRefCount& /*unused*/) {}
+    EnableIntrusiveRefCount& operator=(
+        const EnableIntrusiveRefCount& /*unused*/) {
+        return *this;
+    }
+    ~EnableIntrusiveRefCount() = default;
+
+  public:
+    IntrusivePtr<T> intrusiveFromThis() {
+        return IntrusivePtr<T>(static_cast<T*>(this));
+    }
+
+    template <typename U>
+    friend class IntrusivePtr;
+
+    template <typename U>
+    friend class SharedPtr;
+};
+
+template <typename T>
+class IntrusivePtr {
+  private:
+    T* ptr = nullptr;
+
+    void acquire() {
+        if (ptr != nullptr) {
+            intrusiveBaseOf(ptr)->addIntrusiveRef();
+        }
+    }
+
+  public:
+    IntrusivePtr() {}
+
+    explicit IntrusivePtr(T* other_ptr) : ptr(other_ptr) {
+        acquire();
+    }
+
+    // shares the control block of shp, without any allocation. An aliasing
+    // shp, whose block does not own the object, throws
+    // std::invalid_argument.
+    IntrusivePtr(const SharedPtr<T>& shp) {
+        if (shp.ptr != nullptr &&
+            intrusiveBaseOf(shp.ptr)->intrusive_owner != shp.cb) {
+            throw std::invalid_argument("not owned by its control block");
+        }
+        ptr = shp.ptr;
+        acquire();
+    }
+
+    IntrusivePtr(const IntrusivePtr& ip) : ptr(ip.ptr) {
+        acquire();
+    }
+
+    IntrusivePtr(IntrusivePtr&& ip) noexcept : ptr(ip.ptr) {
+        ip.ptr = nullptr;
+    }
+
+    template <typename U>
+    IntrusivePtr(const IntrusivePtr<U>& ip) : ptr(ip.get()) {
+        acquire();
+    }
+
+    IntrusivePtr& operator=(const IntrusivePtr& ip) {
+        IntrusivePtr copy(ip);
+        swap(copy);
+        return *this;
+    }
+
+    IntrusivePtr& operator=(IntrusivePtr&& ip) noexcept {
+        IntrusivePtr copy(std::move(ip));
+        swap(copy);
+        return *this;
+    }
+
+    ~IntrusivePtr() {
+        if (ptr != nullptr && intrusiveBaseOf(ptr)->releaseIntrusiveRef()) {
+            delete ptr;
+        }
+    }
+
+    void reset() {
+        IntrusivePtr().swap(*this);
+    }
+
+    void reset(T* other_ptr) {
+        IntrusivePtr(other_ptr).swap(*this);
+    }
+
+    void swap(IntrusivePtr& ip) noexcept {
+        std::swap(ptr, ip.ptr);
+    }
+
+    uint use_count() const {
+        return ptr == nullptr ? 0 : intrusiveBaseOf(ptr)->intrusiveCount();
+    }
+
+    T& operator*() const {
+        return *ptr;
+    }
+
+    T* operator->() const {
+        return ptr;
+    }
+
+    T* get() const {
+        return ptr;
+    }
+};
+
+// One-word handle for objects made by makeShared<T>. Such an object sits at
+// a fixed offset inside its MakeSharedControlBlock, so the block pointer is
+// enough to find it. Converting a SharedPtr that owns anything else, such as
+// a raw pointer, an aliased member or a block from another allocator, throws
+// std::invalid_argument.
+template <typename T>
+class CompactSharedPtr {
+    static_assert(!std::is_array_v<T>, "arrays are not supported");
+
+  private:
+    using Block = detail::MakeSharedControlBlock<T, std::allocator<T>>;
+
+    detail::BaseControlBlock* cb = nullptr;
+
+    static detail::BaseControlBlock* blockOf(const SharedPtr<T>& shp) {
+        if (!isCompactible(shp)) {
+            throw std::invalid_argument("not owned by a makeShared block");
+        }
+        return shp.cb;
+    }
+
+  public:
+    CompactSharedPtr() {}
+
+    explicit CompactSharedPtr(const SharedPtr<T>& shp) : cb(blockOf(shp)) {
+        if (cb != nullptr) {
+            cb->addShared();
+        }
+    }
+
+    explicit CompactSharedPtr(SharedPtr<T>&& shp) : cb(blockOf(shp)) {
+        shp.cb = nullptr;
+        shp.ptr = nullptr;
+    }
+
+    CompactSharedPtr(const CompactSharedPtr& csp) : cb(csp.cb) {
+        if (cb != nullptr) {
+            cb->addShared();
+        }
+    }
+
+    CompactSharedPtr(CompactSharedPtr&& csp) noexcept : cb(csp.cb) {
+        csp.cb = nullptr;
+    }
+
+    CompactSharedPtr& operator=(const CompactSharedPtr& csp) {
+        CompactSharedPtr copy(csp);
+        swap(copy);
+        return *this;
+    }
+
+    CompactSharedPtr& operator=(CompactSharedPtr&& csp) noexcept {
+        CompactSharedPtr copy(std::move(csp));
+        swap(copy);
+        return *this;
+    }
+
+    ~CompactSharedPtr() {
+        if (cb != nullptr) {
+            cb->releaseShared();
+        }
+    }
+
+    static bool isCompactible(const SharedPtr<T>& shp) {
+        return shp.cb == nullptr ||
+               (shp.cb->manager == &Block::manage &&
+                shp.ptr == static_cast<Block*>(shp.cb)->getObject());
+    }
+
+    operator SharedPtr<T>() const& {
+        if (cb != nullptr) {
+            cb->addShared();
+        }
+        return SharedPtr<T>(detail::AdoptControlBlock(), get(), cb);
+    }
+
+    operator SharedPtr<T>() && {
+        SharedPtr<T> shp(detail::AdoptControlBlock(), get(), cb);
+        cb = nullptr;
+        return shp;
+    }
+
+    uint use_count() const {
+        return cb == nullptr ? 0 : cb->sharedCount();
+    }
+
+    void reset() {
+        CompactSharedPtr().swap(*this);
+    }
+
+    void swap(CompactSharedPtr& csp) noexcept {
+        std::swap(cb, csp.cb);
+    }
+
+    T& operator*() const {
+        return *get();
+    }
+
+    T* operator->() const {
+        return get();
+    }
+
+    T* get() const {
+        return cb == nullptr ? nullptr : static_cast<Block*>(cb)->getObject();
+    }
+};
+
+// Keyed cache of WeakPtrs. Entries are stored densely, and sweep() drops
+// the expired ones in one linear pass that compares block addresses against
+// the table's inbox instead of reading every control block. Not
+// thread-safe itself; objects may die on any thread.
+template <typename K, typename T>
+class WeakPtrTable {
+  private:
+    struct Entry {
+        K key;
+        WeakPtr<T> handle;
+    };
+
+    std::vector<Entry> entries;
+    std::unordered_map<K, size_t> positions;
+    detail::ExpiryInbox inbox;
+
+    void eraseAt(size_t position) {
+        positions.erase(entries[position].key);
+        if (position + 1 != entries.size()) {
+            entries[position] = std::move(entries.back());
+            positions[entries[position].key] = position;
+        }
+        entries.pop_back();
+    }
+
+  public:
+    WeakPtrTable() {}
+
+    WeakPtrTable(const WeakPtrTable&) = delete;
+    WeakPtrTable& operator=(const WeakPtrTable&) = delete;
+
+    ~WeakPtrTable() {
+        detail::ExpiryLog::unsubscribe(&inbox);
+    }
+
+    void insert(const K& key, const SharedPtr<T>& shp) {
+        detail::ExpiryLog::watch(shp.cb, &inbox);
+        auto [it, inserted] = positions.try_emplace(key, entries.size());
+        if (inserted) {
+            entries.push_back({key, WeakPtr<T>(shp)});
+        } else {
+            detail::ExpiryLog::unwatch(entries[it->second].handle.cb, &inbox);
+            entries[it->second].handle = shp;
+        }
+    }
+
+    // empty when the key is missing or its object is gone
+    SharedPtr<T> lock(const K& key) const {
+        auto it = positions.find(key);
+        return it == positions.end() ? SharedPtr<T>()
+                                     : entries[it->second].handle.lock();
+    }
+
+    bool erase(const K& key) {
+        auto it = positions.find(key);
+        if (it == positions.end()) {
+            return false;
+        }
+        detail::ExpiryLog::unwatch(entries[it->second].handle.cb, &inbox);
+        eraseAt(it->second);
+        return true;
+    }
+
+    // drops all entries whose object died and returns how many
+    size_t sweep() {
+        std::vector<detail::BaseControlBlock*> expired =
+            detail::ExpiryLog::take(&inbox);
+        std::sort(expired.begin(), expired.end());
+        size_t swept = 0;
+        for (size_t position = 0; position < entries.size();) {
+            if (std::binary_search(expired.begin(), expired.end(),
+                                   entries[position].handle.cb)) {
+                eraseAt(position);
+                ++swept;
+            } else {
+                ++position;
+            }
+        }
+        detail::ExpiryLog::release(expired);
+        return swept;
+    }
+
+    size_t size() const {
+        return entries.size();
+    }
+};
+
+// Read guard returned by AtomicSharedPtr::borrow(). The object is pinned by
+// a hazard pointer rather than a reference, so taking and dropping a borrow
+// writes nothing shared. share() upgrades it to a counted SharedPtr.
+template <typename T>
+class BorrowedPtr {
+  public:
+    using element_type = std::remove_extent_t<T>;
+
+  private:
+    const SharedPtr<T>* handle = nullptr;
+    detail::HazardDomain::Record* record = nullptr;
+
+    BorrowedPtr(const SharedPtr<T>* handle,
+                detail::HazardDomain::Record* record)
+        : handle(handle), record(record) {}
+
+  public:
+    BorrowedPtr() {}
+
+    BorrowedPtr(const BorrowedPtr&) = delete;
+    BorrowedPtr& operator=(const BorrowedPtr&) = delete;
+
+    BorrowedPtr(BorrowedPtr&& bp) noexcept
+        : handle(bp.handle), record(bp.record) {
+        bp.handle = nullptr;
+        bp.record = nullptr;
+    }
+
+    BorrowedPtr& operator=(BorrowedPtr&& bp) noexcept {
+        BorrowedPtr copy(std::move(bp));
+        swap(copy);
+        return *this;
+    }
+
+    ~BorrowedPtr() {
+        if (record != nullptr) {
+            detail::HazardDomain::release(record);
+        }
+    }
+
+    void swap(BorrowedPtr& bp) noexcept {
+        std::swap(handle, bp.handle);
+        std::swap(record, bp.record);
+    }
+
+    SharedPtr<T> share() const {
+        return handle == nullptr ? SharedPtr<T>() : *handle;
+    }
+
+    std::add_lvalue_reference_t<element_type> operator*() const {
+        return *get();
+    }
+
+    element_type* operator->() const {
+        return get();
+    }
+
+    element_type* get() const {
+        return handle == nullptr ? nullptr : handle->get();
+    }
+
+    template <typename Handle>
+    friend class AtomicHandle;
+};
+
+template <typename Handle>
+struct SharedPtrTarget {};
+
+template <typename T>
+struct SharedPtrTarget<SharedPtr<T>> {
+    using type = T;
+};
+
+// Atomic slot for a SharedPtr or WeakPtr using split reference counts.
+// Every stored value lives in a Node, and the slot is a single word that
+// packs the Node pointer with the number of loads currently reading it.
+// load() bumps that local count, copies the handle and then gives the local
+// reference back; a store that replaces the Node first moves the pending
+// local references into the Node's own count. Loads are lock-free; stores
+// allocate a Node. Assumes 48-bit user-space addresses.
+// borrow() pins the current Node with a hazard pointer instead, so a Node
+// whose count drops to zero goes through HazardDomain::retire().
+// Only available with SMART_POINTERS_THREAD_SAFE.
+template <typename Handle>
+class AtomicHandle {
+  private:
+    struct Node {
+        Handle value;
+        std::atomic<int> count{1};
+    };
+
+    static constexpr int kPointerBits = 48;
+    static constexpr uintptr_t kLocalRef = uintptr_t(1) << kPointerBits;
+    static constexpr uintptr_t kPointerMask = kLocalRef - 1;
+
+    static_assert(sizeof(uintptr_t) == 8, "needs 64-bit pointers");
+    static_assert(detail::kThreadSafeCounting<Handle>,
+                  "AtomicHandle needs SMART_POINTERS_THREAD_SAFE");
+
+    std::atomic<uintptr_t> state{0};
+
+    static Node* nodeOf(uintptr_t word) {
+        return reinterpret_cast<Node*>(word & kPointerMask);
+    }
+    static int localRefsOf(uintptr_t word) {
+        return static_cast<int>(word >> kPointerBits);
+    }
+    static uintptr_t wordOf(Node* node) {
+        return reinterpret_cast<uintptr_t>(node);
+    }
+
+    // empty values get a Node too: a Node address is never stored twice
+    // while it is alive, which rules out ABA on the packed word. Only a
+    // default-constructed slot holds the null word, and it never returns.
+    static Node* makeNode(Handle value) {
+        return new Node{std::move(value)};
+    }
+
+    // adds delta to the node's count and frees it when that reaches zero
+    static void adjust(Node* node, int delta) {
+        if (node != nullptr &&
+            node->count.fetch_add(delta, std::memory_order_acq_rel) + delta ==
+                0) {
+            detail::HazardDomain::retire(node, [](void* object) {
+                delete static_cast<Node*>(object);
+            });
+        }
+    }
+
+    // the slot's own reference plus the pending local ones move to the node
+    static void retire(uintptr_t word) {
+        adjust(nodeOf(word), localRefsOf(word) - 1);
+    }
+
+    uintptr_t acquireLocal() const {
+        return const_cast<std::atomic<uintptr_t>&>(state).fetch_add(
+                   kLocalRef, std::memory_order_acquire) +
+               kLocalRef;
+    }
+
+    void releaseLocal(Node* node) const {
+        auto& slot = const_cast<std::atomic<uintptr_t>&>(state);
+        uintptr_t current = slot.load(std::memory_order_relaxed);
+        while (nodeOf(current) == node) {
+            if (slot.compare_exchange_weak(current, current - kLocalRef,
+                                           std::memory_order_release,
+                                           std::memory_order_relaxed)) {
+                return;
+            }
+        }
+        // replaced meanwhile: our local reference now sits in node->count
+        adjust(node, -1);
+    }
+
+    static bool sameValue(Node* node, const Handle& handle) {
+        return node == nullptr ? handle.cb == nullptr
+                               : node->value.cb == handle.cb &&
+                                     node->value.ptr == handle.ptr;
+    }
+
+    static Handle valueOf(Node* node) {
+        return node == nullptr ? Handle() : node->value;
+    }
+
+  public:
+    AtomicHandle() {}
+
+    AtomicHandle(Handle desired)
+        : state(wordOf(makeNode(std::move(desired)))) {}
+
+    AtomicHandle(const AtomicHandle&) = delete;
+    AtomicHandle& operator=(const AtomicHandle&) = delete;
+
+    ~AtomicHandle() {
+        retire(state.load(std::memory_order_acquire));
+    }
+
+    static constexpr bool is_always_lock_free =
+        std::atomic<uintptr_t>::is_always_lock_free;
+
+    bool is_lock_free() const {
+        return state.is_lock_free();
+    }
+
+    Handle load() const {
+        Node* node = nodeOf(acquireLocal());
+        Handle result = valueOf(node);
+        releaseLocal(node);
+        return result;
+    }
+
+    operator Handle() const {
+        return load();
+    }
+
+    // reads the current SharedPtr without touching any reference count
+    template <typename H = Handle>
+    BorrowedPtr<typename SharedPtrTarget<H>::type> borrow() const {
+        detail::HazardDomain::Record* record = detail::HazardDomain::acquire();
+        uintptr_t word = state.load();
+        while (true) {
+            Node* node = nodeOf(word);
+            record->pointer.store(node);
+            uintptr_t current = state.load();
+            if (nodeOf(current) == node) {
+                return {node == nullptr ? nullptr : &node->value, record};
+            }
+            word = current;
+        }
+    }
+
+    // Nodes are swapped out with seq_cst so that retire() observes any
+    // hazard published before the borrow() re-check
+    void store(Handle desired) {
+        retire(state.exchange(wordOf(makeNode(std::move(desired)))));
+    }
+
+    AtomicHandle& operator=(Handle desired) {
+        store(std::move(desired));
+        return *this;
+    }
+
+    Handle exchange(Handle desired) {
+        uintptr_t word = state.exchange(wordOf(makeNode(std::move(desired))));
+        Handle result = valueOf(nodeOf(word));
+        retire(word);
+        return result;
+    }
+
+    // succeeds when the slot holds the same pointer and control block as
+    // expected; on failure expected receives the current value
+    bool compare_exchange_strong(Handle& expected, Handle desired) {
+        Node* desired_node = makeNode(std::move(desired));
+        while (true) {
+            Node* node = nodeOf(acquireLocal());
+            if (!sameValue(node, expected)) {
+                expected = valueOf(node);
+                releaseLocal(node);
+                adjust(desired_node, -1);
+                return false;
+            }
+            uintptr_t current = state.load(std::memory_order_relaxed);
+            while (nodeOf(current) == node) {
+                if (state.compare_exchange_weak(current, wordOf(desired_node),
+                                                std::memory_order_seq_cst,
+                                                std::memory_order_relaxed)) {
+                    // drops our local reference along with the slot's one
+                    adjust(node, localRefsOf(current) - 2);
+                    return true;
+                }
+            }
+            adjust(node, -1);
+        }
+    }
+
+    bool compare_exchange_weak(Handle& expected, Handle desired) {
+        return compare_exchange_strong(expected, std::move(desired));
+    }
+};
+
+template <typename T>
+using AtomicSharedPtr = AtomicHandle<SharedPtr<T>>;
+
+template <typename T>
+using AtomicWeakPtr = AtomicHandle<WeakPtr<T>>;
+
+template <typename T, typename Base, size_t Align, typename Alloc,
+          typename... Args>
+SharedPtr<T> allocateSharedWithBase(const Alloc& alloc, Args&&... args) {
+    using MSCB = detail::MakeSharedControlBlock<T, Alloc, Base, Align>;
+    using MSCB_Alloc =
         typename std::allocator_traits<Alloc>::template rebind_alloc<MSCB>;
     using MSCB_AllocTraits = std::allocator_traits<MSCB_Alloc>;
 
     SharedPtr<T> shp;
     MSCB_Alloc MSCB_allocator = alloc;
     MSCB* MSCB_ptr = MSCB_AllocTraits::allocate(MSCB_allocator, 1);
-    MSCB_AllocTraits::construct(MSCB_allocator, MSCB_ptr,
-                                std::forward<Args>(args)...);
+    try {
+        MSCB_AllocTraits::construct(MSCB_allocator, MSCB_ptr,
+                                    std::allocator_arg, alloc,
+                                    std::forward<Args>(args)...);
+    } catch (...) {
+        MSCB_AllocTraits::deallocate(MSCB_allocator, MSCB_ptr, 1);
+        throw;
+    }
     shp.cb = MSCB_ptr;
     MSCB_ptr->shared_count = 1u;
-    shp.ptr = reinterpret_cast<T*>(MSCB_ptr->object);
-    MSCB_ptr->allocator = std::move(MSCB_allocator);
+    MSCB_ptr->weak_count = 1u;
+    shp.ptr = MSCB_ptr->getObject();
+    shp.attachToObject(shp.ptr);
+    return shp;
+}
+
+// Makes size objects from args in one allocation. Each result owns its
+// own object; the allocation is freed once all of them and their WeakPtrs
+// are gone.
+template <typename T, typename Alloc, typename... Args>
+std::vector<SharedPtr<T>> allocateSharedBatch(const Alloc& alloc, size_t size,
+                                              const Args&... args) {
+    static_assert(!std::is_array_v<T>, "arrays are not supported");
+    using Slab = detail::BatchSlab<T, Alloc>;
+
+    std::vector<SharedPtr<T>> batch;
+    if (size == 0) {
+        return batch;
+    }
+    batch.reserve(size);
+    Slab* slab = Slab::create(alloc, size, args...);
+    for (size_t i = 0; i < size; ++i) {
+        typename Slab::Block* block = slab->block(i);
+        batch.push_back(SharedPtr<T>(detail::AdoptControlBlock(),
+                                     block->getObject(), block));
+        batch.back().attachToObject(batch.back().ptr);
+    }
+    return batch;
+}
+
+template <typename T, typename... Args>
+std::vector<SharedPtr<T>> makeSharedBatch(size_t size, const Args&... args) {
+    return allocateSharedBatch<T>(std::allocator<T>(), size, args...);
+}
+
+// allocateShared<T[]>(alloc, n[, value]) and allocateShared<T[N]>(alloc
+// [, value]) put the control block and all elements in one allocation.
+template <typename T, typename Alloc, typename... Args>
+SharedPtr<T> allocateSharedArray(const Alloc& alloc, Args&&... args) {
+    using MSACB =
+        detail::MakeSharedArrayControlBlock<std::remove_extent_t<T>, Alloc>;
+
+    MSACB* block = nullptr;
+    if constexpr (std::is_bounded_array_v<T>) {
+        block = MSACB::create(alloc, std::extent_v<T>, args...);
+    } else {
+        block = MSACB::create(alloc, args...);
+    }
+    return SharedPtr<T>(detail::AdoptControlBlock(), block->elements(), block);
+}
+
+template <typename T, typename Alloc, typename... Args>
+SharedPtr<T> allocateSharedSplit(const Alloc& alloc, Args&&... args) {
+    static_assert(!std::is_array_v<T>, "arrays are not supported");
+    using SCB = detail::SplitControlBlock<T, Alloc>;
+    using SCB_Alloc = typename SCB::SCB_Alloc;
+    using SCB_AllocTraits = std::allocator_traits<SCB_Alloc>;
+
+    SCB_Alloc SCB_allocator = alloc;
+    SCB* SCB_ptr = SCB_AllocTraits::allocate(SCB_allocator, 1);
+    try {
+        new (SCB_ptr) SCB(alloc, std::forward<Args>(args)...);
+    } catch (...) {
+        SCB_AllocTraits::deallocate(SCB_allocator, SCB_ptr, 1);
+        throw;
+    }
+    SCB_ptr->shared_count = 1u;
+    SCB_ptr->weak_count = 1u;
+    SharedPtr<T> shp(detail::AdoptControlBlock(), SCB_ptr->object, SCB_ptr);
+    shp.attachToObject(SCB_ptr->object);
     return shp;
 }
 
+template <typename T, typename Alloc, typename... Args>
+SharedPtr<T> allocateShared(const Alloc& alloc,
+                            Args&&... args) {  // todo do const Alloc
+    if constexpr (std::is_array_v<T>) {
+        return allocateSharedArray<T>(alloc, std::forward<Args>(args)...);
+    } else {
+        return allocateSharedWithBase<T, detail::BaseControlBlock>(
+            alloc, std::forward<Args>(args)...);
+    }
+}
+
 template <typename T, typename... Args>
 SharedPtr<T> makeShared(Args&&... args) {
-    return allocateShared<T>(std::allocator<T>(), std::forward<Args>(args)...);
+    return allocateShared<T>(std::allocator<std::remove_extent_t<T>>(),
+                             std::forward<Args>(args)...);
+}
+
+template <typename T, typename... Args>
+SharedPtr<T> makeSharedSplit(Args&&... args) {
+    return allocateSharedSplit<T>(std::allocator<T>(),
+                                  std::forward<Args>(args)...);
+}
+
+// The object (or every array element) is default-initialized, so trivial
+// types are left uninitialized for the caller to fill.
+template <typename T, typename Alloc>
+SharedPtr<T> allocateSharedForOverwrite(const Alloc& alloc) {
+    return allocateShared<T>(alloc, detail::DefaultInit());
+}
+
+template <typename T, typename Alloc>
+SharedPtr<T> allocateSharedForOverwrite(const Alloc& alloc, size_t size) {
+    static_assert(std::is_unbounded_array_v<T>);
+    return allocateShared<T>(alloc, size, detail::DefaultInit());
+}
+
+template <typename T>
+SharedPtr<T> makeSharedForOverwrite() {
+    return allocateSharedForOverwrite<T>(
+        std::allocator<std::remove_extent_t<T>>());
+}
+
+template <typename T>
+SharedPtr<T> makeSharedForOverwrite(size_t size) {
+    return allocateSharedForOverwrite<T>(
+        std::allocator<std::remove_extent_t<T>>(), size);
+}
+
+// Copies and releases on the allocating thread skip atomic operations. Only
+// available with SMART_POINTERS_THREAD_SAFE: without it every count is
+// already non-atomic and the foreign-thread paths would race.
+template <typename T, typename Alloc, typename... Args>
+SharedPtr<T> allocateSharedBiased(const Alloc& alloc, Args&&... args) {
+    static_assert(detail::kThreadSafeCounting<T>,
+                  "biased counts need SMART_POINTERS_THREAD_SAFE");
+    return allocateSharedWithBase<T, detail::BiasedControlBlock>(
+        alloc, std::forward<Args>(args)...);
+}
+
+template <typename T, typename... Args>
+SharedPtr<T> makeSharedBiased(Args&&... args) {
+    return allocateSharedBiased<T>(std::allocator<T>(),
+                                   std::forward<Args>(args)...);
+}
+
+// Copies on different threads update different cache lines, see
+// ShardedControlBlock.
+template <typename T, typename Alloc, typename... Args>
+ShardedSharedPtr<T> allocateSharedSharded(const Alloc& alloc,
+                                          Args&&... args) {
+    return ShardedSharedPtr<T>(
+        allocateSharedWithBase<T, detail::ShardedControlBlock>(
+            alloc, std::forward<Args>(args)...));
+}
+
+template <typename T, typename... Args>
+ShardedSharedPtr<T> makeSharedSharded(Args&&... args) {
+    return allocateSharedSharded<T>(std::allocator<T>(),
+                                    std::forward<Args>(args)...);
+}
+
+// The last release queues the destructor on queue instead of running it.
+template <typename T, typename Alloc, typename... Args>
+SharedPtr<T> allocateSharedDeferred(const Alloc& alloc,
+                                    DestructionQueue& queue, Args&&... args) {
+    static_assert(!std::is_array_v<T>, "arrays are not supported");
+    using MSCB = detail::MakeSharedControlBlock<T, Alloc,
+                                                detail::DeferredControlBlock>;
+    using MSCB_Alloc = typename MSCB::MSCB_Alloc;
+    using MSCB_AllocTraits = std::allocator_traits<MSCB_Alloc>;
+
+    MSCB_Alloc MSCB_allocator = alloc;
+    MSCB* MSCB_ptr = MSCB_AllocTraits::allocate(MSCB_allocator, 1);
+    try {
+        MSCB_AllocTraits::construct(MSCB_allocator, MSCB_ptr,
+                                    std::allocator_arg, alloc,
+                                    std::forward<Args>(args)...);
+    } catch (...) {
+        MSCB_AllocTraits::deallocate(MSCB_allocator, MSCB_ptr, 1);
+        throw;
+    }
+    MSCB_ptr->queue = &queue;
+    MSCB_ptr->shared_count = 1u;
+    MSCB_ptr->weak_count = 1u;
+    SharedPtr<T> shp(detail::AdoptControlBlock(), MSCB_ptr->getObject(),
+                     MSCB_ptr);
+    shp.attachToObject(shp.ptr);
+    return shp;
+}
+
+template <typename T, typename... Args>
+SharedPtr<T> makeSharedDeferred(DestructionQueue& queue, Args&&... args) {
+    return allocateSharedDeferred<T>(std::allocator<T>(), queue,
+                                     std::forward<Args>(args)...);
+}
+
+// The counters get a cache line of their own, so copies on other cores do
+// not invalidate the line readers of the object are scanning.
+template <typename T, typename Alloc, typename... Args>
+SharedPtr<T> allocateSharedIsolated(const Alloc& alloc, Args&&... args) {
+    return allocateSharedWithBase<T, detail::BaseControlBlock,
+                                  std::max(alignof(T), kCacheLineSize)>(
+        alloc, std::forward<Args>(args)...);
+}
+
+template <typename T, typename... Args>
+SharedPtr<T> makeSharedIsolated(Args&&... args) {
+    return allocateSharedIsolated<T>(std::allocator<T>(),
+                                     std::forward<Args>(args)...);
+}
+
+template <typename T, typename... Args>
+CompactSharedPtr<T> makeSharedCompact(Args&&... args) {
+    return CompactSharedPtr<T>(makeShared<T>(std::forward<Args>(args)...));
+}
+
+// The block is laid out and counted as by allocateShared, so the result
+// converts into a SharedPtr for free. Intrusive references and iterative
+// teardown go through the block from the start; the EnableSharedFromThis
+// base is only wired once the object is shared.
+template <typename T, typename Alloc, typename... Args>
+UniquePtr<T> allocateUniqueShareable(const Alloc& alloc, Args&&... args) {
+    using MSCB = detail::MakeSharedControlBlock<T, Alloc>;
+    using MSCB_Alloc = typename MSCB::MSCB_Alloc;
+    using MSCB_AllocTraits = std::allocator_traits<MSCB_Alloc>;
+
+    MSCB_Alloc MSCB_allocator = alloc;
+    MSCB* MSCB_ptr = MSCB_AllocTraits::allocate(MSCB_allocator, 1);
+    try {
+        MSCB_AllocTraits::construct(MSCB_allocator, MSCB_ptr,
+                                    std::allocator_arg, alloc,
+                                    std::forward<Args>(args)...);
+    } catch (...) {
+        MSCB_AllocTraits::deallocate(MSCB_allocator, MSCB_ptr, 1);
+        throw;
+    }
+    MSCB_ptr->shared_count = 1u;
+    MSCB_ptr->weak_count = 1u;
+    SharedPtr<T>::attachCounting(MSCB_ptr->getObject(), MSCB_ptr);
+    return UniquePtr<T>(MSCB_ptr->getObject(), MSCB_ptr);
+}
+
+template <typename T, typename... Args>
+UniquePtr<T> makeUniqueShareable(Args&&... args) {
+    return allocateUniqueShareable<T>(std::allocator<T>(),
+                                      std::forward<Args>(args)...);
+}
+
+// The deleter shp was created with, or nullptr if it has none of that type.
+template <typename Delete, typename T>
+Delete* getDeleter(const SharedPtr<T>& shp) {
+    if (shp.cb == nullptr) {
+        return nullptr;
+    }
+    return static_cast<Delete*>(
+        shp.cb->manager(shp.cb, detail::ControlOp::GetDeleter,
+                        &detail::DeleterKey<Delete>::key));
+}
+
+// Casts keep sharing the control block of shp. The rvalue overloads hand
+// its reference over instead of taking a new one; a failed dynamic cast
+// leaves shp untouched.
+template <typename T, typename U>
+SharedPtr<T> staticPointerCast(const SharedPtr<U>& shp) {
+    return SharedPtr<T>(
+        shp, static_cast<typename SharedPtr<T>::element_type*>(shp.get()));
+}
+
+template <typename T, typename U>
+SharedPtr<T> staticPointerCast(SharedPtr<U>&& shp) {
+    auto* casted = static_cast<typename SharedPtr<T>::element_type*>(shp.get());
+    return SharedPtr<T>(std::move(shp), casted);
+}
+
+template <typename T, typename U>
+SharedPtr<T> dynamicPointerCast(const SharedPtr<U>& shp) {
+    auto* casted =
+        dynamic_cast<typename SharedPtr<T>::element_type*>(shp.get());
+    return casted == nullptr ? SharedPtr<T>() : SharedPtr<T>(shp, casted);
+}
+
+template <typename T, typename U>
+SharedPtr<T> dynamicPointerCast(SharedPtr<U>&& shp) {
+    auto* casted =
+        dynamic_cast<typename SharedPtr<T>::element_type*>(shp.get());
+    return casted == nullptr ? SharedPtr<T>()
+                             : SharedPtr<T>(std::move(shp), casted);
+}
+
+template <typename T, typename U>
+SharedPtr<T> constPointerCast(const SharedPtr<U>& shp) {
+    return SharedPtr<T>(
+        shp, const_cast<typename SharedPtr<T>::element_type*>(shp.get()));
+}
+
+template <typename T, typename U>
+SharedPtr<T> constPointerCast(SharedPtr<U>&& shp) {
+    auto* casted = const_cast<typename SharedPtr<T>::element_type*>(shp.get());
+    return SharedPtr<T>(std::move(shp), casted);
+}
+
+// the object of cb as a T, if cb created it as exactly that type
+template <typename T>
+T* objectOfType(detail::BaseControlBlock* cb) {
+    static_assert(!std::is_array_v<T>, "arrays are not supported");
+    if (cb == nullptr) {
+        return nullptr;
+    }
+    return static_cast<T*>(
+        cb->manager(cb, detail::ControlOp::GetObject,
+                    &detail::ObjectKey<std::remove_cv_t<T>>::key));
+}
+
+// Checked downcast from any SharedPtr, SharedPtr<void> included: the result
+// owns the object of shp's block if that was created as exactly T (up to
+// cv), and is empty otherwise. Asks the block instead of using RTTI, so a
+// base class of the object does not match. The rvalue overload hands the
+// reference over on success and leaves shp untouched otherwise.
+template <typename T, typename U>
+SharedPtr<T> sharedCast(const SharedPtr<U>& shp) {
+    T* object = objectOfType<T>(shp.cb);
+    if (object == nullptr) {
+        return SharedPtr<T>();
+    }
+    shp.cb->addShared();
+    return SharedPtr<T>(detail::AdoptControlBlock(), object, shp.cb);
+}
+
+template <typename T, typename U>
+SharedPtr<T> sharedCast(SharedPtr<U>&& shp) {
+    T* object = objectOfType<T>(shp.cb);
+    if (object == nullptr) {
+        return SharedPtr<T>();
+    }
+    shp.ptr = nullptr;
+    return SharedPtr<T>(detail::AdoptControlBlock(), object,
+                        std::exchange(shp.cb, nullptr));
+}
+
+// SharedPtrs compare by the pointer they hold, as standard ones do.
+template <typename T, typename U>
+bool operator==(const SharedPtr<T>& lhs, const SharedPtr<U>& rhs) noexcept {
+    return lhs.get() == rhs.get();
+}
+
+template <typename T>
+bool operator==(const SharedPtr<T>& lhs, std::nullptr_t /*unused*/) noexcept {
+    return lhs.get() == nullptr;
+}
+
+template <typename T>
+bool operator==(const UniquePtr<T>& lhs, std::nullptr_t /*unused*/) noexcept {
+    return lhs.get() == nullptr;
+}
+
+template <typename T, typename U>
+std::strong_ordering operator<=>(const SharedPtr<T>& lhs,
+                                 const SharedPtr<U>& rhs) noexcept {
+    return std::compare_three_way()(lhs.get(), rhs.get());
+}
+
+template <typename T>
+std::strong_ordering operator<=>(const SharedPtr<T>& lhs,
+                                 std::nullptr_t /*unused*/) noexcept {
+    return std::compare_three_way()(
+        lhs.get(), static_cast<typename SharedPtr<T>::element_type*>(nullptr));
+}
+
+// Owner-based functors for any mix of SharedPtr and WeakPtr. They are
+// transparent, so a container keyed by WeakPtr can be searched with a
+// SharedPtr without creating a WeakPtr, and so without touching any count.
+struct OwnerLess {
+    using is_transparent = void;
+
+    template <typename L, typename R>
+    bool operator()(const L& lhs, const R& rhs) const noexcept {
+        return lhs.ownerBefore(rhs);
+    }
+};
+
+struct OwnerEqual {
+    using is_transparent = void;
+
+    template <typename L, typename R>
+    bool operator()(const L& lhs, const R& rhs) const noexcept {
+        return lhs.ownerEqual(rhs);
+    }
+};
+
+struct OwnerHash {
+    using is_transparent = void;
+
+    template <typename Handle>
+    size_t operator()(const Handle& handle) const noexcept {
+        return handle.ownerHash();
+    }
+};
+
+namespace std {
+template <typename T>
+struct hash<SharedPtr<T>> {
+    size_t operator()(const SharedPtr<T>& shp) const noexcept {
+        return hash<typename SharedPtr<T>::element_type*>()(shp.get());
+    }
+};
+
+// WeakPtrs have no stable value to hash, so they hash and compare by owner;
+// this makes std::unordered_map<WeakPtr<T>, V> work as is
+template <typename T>
+struct hash<WeakPtr<T>> : OwnerHash {};
+
+template <typename T>
+struct equal_to<WeakPtr<T>> : OwnerEqual {};
+}  // namespace std
+
+// Copies count handles from first to out. All handles that share a control
+// block take their references in a single update, wherever they sit in the
+// range, which saves most of the atomic traffic when a container repeats the
+// same objects. The range is walked in windows of up to eight distinct
+// blocks, so a range over more blocks than that updates some of them once
+// per window.
+template <typename ForwardIt, typename OutputIt>
+OutputIt shareN(ForwardIt first, size_t count, OutputIt out) {
+    using Handle = typename std::iterator_traits<ForwardIt>::value_type;
+    while (count != 0) {
+        detail::BlockTally tally;
+        ForwardIt window_end = first;
+        while (count != 0 && tally.add(window_end->cb)) {
+            ++window_end;
+            --count;
+        }
+
+        tally.addShared();
+        for (; first != window_end; ++first) {
+            try {
+                *out = Handle(detail::AdoptControlBlock(), first->ptr,
+                              first->cb);
+            } catch (...) {
+                // the rejected handle released itself, the rest of the
+                // window is still ours
+                detail::BlockTally rest;
+                for (ForwardIt it = std::next(first); it != window_end; ++it) {
+                    rest.add(it->cb);
+                }
+                rest.releaseShared();
+                throw;
+            }
+            ++out;
+        }
+    }
+    return out;
+}
+
+// Resets count handles from first on, releasing the handles of each control
+// block with a single update per window, as in shareN().
+template <typename ForwardIt>
+void releaseN(ForwardIt first, size_t count) {
+    while (count != 0) {
+        detail::BlockTally tally;
+        while (count != 0 && tally.add(first->cb)) {
+            first->cb = nullptr;
+            first->ptr = nullptr;
+            ++first;
+            --count;
+        }
+        tally.releaseShared();
+    }
+}
+
+// Counters of the calling thread's control block pool.
+inline ControlBlockPoolStats controlBlockPoolStats() {
+    return detail::ControlBlockPool::stats();
+}
+
+// Returns the calling thread's cached control blocks to operator delete.
+inline void trimControlBlockPool() {
+    detail::ControlBlockPool::trim();
+}
+
+#ifdef SMART_POINTERS_THREAD_SAFE
+// Merges the biased counts that other threads handed back to this thread.
+inline void mergeBiasedCounts() {
+    detail::BiasedMergeQueue* queue =
+        detail::BiasedOwnerThread::current().queue;
+    if (queue != nullptr) {
+        queue->drain();
+    }
 }
+#endif
+
+// Bump allocator for short-lived blocks that die together. Released blocks
+// only decrement live_blocks; reset() rewinds to the first chunk in O(1)
+// and keeps every chunk for reuse. Not thread-safe.
+class Arena {
+  public:
+    explicit Arena(size_t chunk_size = 64 * 1024) : chunk_size(chunk_size) {}
+
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    ~Arena() {
+        while (first != nullptr) {
+            Chunk* next = first->next;
+            ::operator delete(first);
+            first = next;
+        }
+    }
+
+    void* allocate(size_t size, size_t align) {
+        while (true) {
+            if (current != nullptr) {
+                auto base = reinterpret_cast<uintptr_t>(current->bytes());
+                size_t offset =
+                    (base + used + align - 1) / align * align - base;
+                if (offset + size <= current->capacity) {
+                    used = offset + size;
+                    ++live_blocks;
+                    return current->bytes() + offset;
+                }
+            }
+            advance(size + align);
+        }
+    }
+
+    void deallocate(void* /*unused*/, size_t /*unused*/) {
+        --live_blocks;
+    }
+
+    void reset() {
+        if (live_blocks != 0) {
+            throw std::logic_error("Arena::reset with live blocks");
+        }
+        current = first;
+        used = 0;
+    }
+
+    size_t liveBlocks() const {
+        return live_blocks;
+    }
+
+  private:
+    struct alignas(std::max_align_t) Chunk {
+        Chunk* next;
+        size_t capacity;
+
+        char* bytes() {
+            return reinterpret_cast<char*>(this + 1);
+        }
+    };
+
+    // moves to the next kept chunk large enough, or allocates a new one
+    void advance(size_t min_capacity) {
+        Chunk* prev = current;
+        Chunk* next = current == nullptr ? first : current->next;
+        while (next != nullptr && next->capacity < min_capacity) {
+            prev = next;
+            next = next->next;
+        }
+        if (next == nullptr) {
+            size_t capacity = std::max(chunk_size, min_capacity);
+            next = static_cast<Chunk*>(
+                ::operator new(sizeof(Chunk) + capacity));
+            next->next = nullptr;
+            next->capacity = capacity;
+            (prev == nullptr ? first : prev->next) = next;
+        }
+        current = next;
+        used = 0;
+    }
+
+    size_t chunk_size;
+    Chunk* first = nullptr;
+    Chunk* current = nullptr;
+    size_t used = 0;
+    size_t live_blocks = 0;
+};
+
+template <typename T>
+struct ArenaAllocator {
+    using value_type = T;
+
+    Arena* arena;
+
+    explicit ArenaAllocator(Arena& arena) : arena(&arena) {}
+
+    template <typename U>
+    ArenaAllocator(const ArenaAllocator<U>& other) : arena(other.arena) {}
+
+    T* allocate(size_t n) {
+        return static_cast<T*>(arena->allocate(n * sizeof(T), alignof(T)));
+    }
+
+    void deallocate(T* ptr, size_t n) {
+        arena->deallocate(ptr, n * sizeof(T));
+    }
+
+    template <typename U>
+    bool operator==(const ArenaAllocator<U>& other) const {
+        return arena == other.arena;
+    }
+};
@@ -0,0 +1,491 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "smart_pointers.h"
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+constexpr auto kDuration = std::chrono::milliseconds(200);
+
+struct Payload {
+    int values[16] = {};
+};
+
+void report(const std::string& name, const std::string& variant,
+            double value, const std::string& unit) {
+    std::cout << name << ',' << variant << ',' << value << ',' << unit
+              << '\n';
+}
+
+// bytes requested from operator new by the current thread
+size_t& allocatedBytes() {
+    thread_local size_t bytes = 0;
+    return bytes;
+}
+
+// keeps the compiler from dropping the handle operations around value
+template <typename T>
+void keep(T& value) {
+    asm volatile("" : : "r"(&value) : "memory");
+}
+
+// The same cases run against SharedPtr and, as the baseline, against
+// std::shared_ptr.
+struct OwnPointers {
+    static constexpr const char* kName = "SharedPtr";
+
+    template <typename T>
+    using Shared = SharedPtr<T>;
+    template <typename T>
+    using Weak = WeakPtr<T>;
+
+    template <typename T>
+    static Shared<T> make() {
+        return makeShared<T>();
+    }
+
+    // blocks cached by earlier cases would hide the allocation of the next
+    static void dropCaches() {
+        trimControlBlockPool();
+    }
+};
+
+struct StdPointers {
+    static constexpr const char* kName = "std::shared_ptr";
+
+    template <typename T>
+    using Shared = std::shared_ptr<T>;
+    template <typename T>
+    using Weak = std::weak_ptr<T>;
+
+    template <typename T>
+    static Shared<T> make() {
+        return std::make_shared<T>();
+    }
+
+    static void dropCaches() {}
+};
+
+// runs op in rounds of kBatch for kDuration and returns ops per second
+template <typename Op>
+double opsPerSecond(Op op) {
+    constexpr int kBatch = 1'000;
+    int64_t ops = 0;
+    auto start = Clock::now();
+    while (Clock::now() - start < kDuration) {
+        for (int i = 0; i < kBatch; ++i) {
+            op();
+        }
+        ops += kBatch;
+    }
+    auto elapsed = std::chrono::duration<double>(Clock::now() - start);
+    return static_cast<double>(ops) / elapsed.count();
+}
+
+template <typename P>
+void benchHandles() {
+    using Handle = typename P::template Shared<Payload>;
+    using Weak = typename P::template Weak<Payload>;
+
+    Handle source = P::template make<Payload>();
+    report("copy_destroy", P::kName, opsPerSecond([&source] {
+               Handle copy = source;
+               keep(copy);
+           }),
+           "ops/s");
+    Handle slot = source;
+    report("move", P::kName, opsPerSecond([&slot] {
+               Handle moved = std::move(slot);
+               keep(moved);
+               slot = std::move(moved);
+           }),
+           "ops/s");
+
+    report("create_destroy_make", P::kName, opsPerSecond([] {
+               Handle created = P::template make<Payload>();
+               keep(created);
+           }),
+           "ops/s");
+    report("create_destroy_raw", P::kName, opsPerSecond([] {
+               Handle created(new Payload);
+               keep(created);
+           }),
+           "ops/s");
+
+    Weak alive = source;
+    report("weak_lock_hit", P::kName, opsPerSecond([&alive] {
+               Handle locked = alive.lock();
+               keep(locked);
+           }),
+           "ops/s");
+    Weak expired = P::template make<Payload>();
+    report("weak_lock_miss", P::kName, opsPerSecond([&expired] {
+               Handle locked = expired.lock();
+               keep(locked);
+           }),
+           "ops/s");
+}
+
+// Every thread copies and destroys handles to one hot object. The rate is
+// taken over the longest time a thread ran, which overshoots kDuration by up
+// to one round.
+template <typename Handle>
+double hotCopyRate(const Handle& hot, int threads) {
+    std::atomic<int64_t> ops = 0;
+    std::vector<double> seconds(threads);
+    std::vector<std::thread> workers;
+    workers.reserve(threads);
+    for (int i = 0; i < threads; ++i) {
+        workers.emplace_back([&hot, &ops, &elapsed = seconds[i]] {
+            int64_t local = 0;
+            auto start = Clock::now();
+            while (Clock::now() - start < kDuration) {
+                for (int j = 0; j < 1'000; ++j) {
+                    Handle copy = hot;
+                    keep(copy);
+                }
+                local += 1'000;
+            }
+            elapsed =
+                std::chrono::duration<double>(Clock::now() - start).count();
+            ops += local;
+        });
+    }
+    for (auto& worker : workers) {
+        worker.join();
+    }
+    double longest = *std::max_element(seconds.begin(), seconds.end());
+    return static_cast<double>(ops.load()) / longest;
+}
+
+template <typename P>
+void benchContention() {
+    using Handle = typename P::template Shared<Payload>;
+
+    Handle shared = P::template make<Payload>();
+    for (int threads : {1, 4}) {
+        report("contended_copy_" + std::to_string(threads) + "t", P::kName,
+               hotCopyRate(shared, threads), "ops/s");
+    }
+}
+
+// SharedPtr(U*) takes its block from ControlBlockPool, which hands out
+// blocks released earlier on the thread and allocates one per block on a
+// miss. The pool is emptied first, so heap_per_object_raw includes the
+// block as the std::shared_ptr figure does.
+template <typename P>
+void benchMemory() {
+    using Handle = typename P::template Shared<Payload>;
+    using Weak = typename P::template Weak<Payload>;
+
+    report("handle_size", P::kName, sizeof(Handle), "bytes");
+    report("weak_handle_size", P::kName, sizeof(Weak), "bytes");
+
+    size_t before = allocatedBytes();
+    {
+        Handle created = P::template make<Payload>();
+        report("heap_per_object_make", P::kName,
+               static_cast<double>(allocatedBytes() - before), "bytes");
+    }
+    P::dropCaches();
+    before = allocatedBytes();
+    {
+        Handle created(new Payload);
+        report("heap_per_object_raw", P::kName,
+               static_cast<double>(allocatedBytes() - before), "bytes");
+    }
+}
+
+void benchShardedCopy() {
+    SharedPtr<Payload> plain = makeShared<Payload>();
+    ShardedSharedPtr<Payload> sharded = makeSharedSharded<Payload>();
+    std::shared_ptr<Payload> baseline = std::make_shared<Payload>();
+    for (int threads : {1, 4, 8}) {
+        std::string name = "hot_copy_" + std::to_string(threads) + "t";
+        report(name, "SharedPtr", hotCopyRate(plain, threads), "ops/s");
+        report(name, "ShardedSharedPtr", hotCopyRate(sharded, threads),
+               "ops/s");
+        report(name, "std::shared_ptr", hotCopyRate(baseline, threads),
+               "ops/s");
+    }
+}
+
+// creates, scans and drops kObjects objects per round
+void benchBatchCreate() {
+    constexpr size_t kObjects = 1'000;
+    std::vector<SharedPtr<Payload>> objects;
+    auto rate = [&](auto create) {
+        int64_t created = 0;
+        int64_t sum = 0;
+        auto start = Clock::now();
+        while (Clock::now() - start < kDuration) {
+            create();
+            for (const SharedPtr<Payload>& object : objects) {
+                sum += object->values[0];
+            }
+            objects.clear();
+            created += kObjects;
+        }
+        auto elapsed = std::chrono::duration<double>(Clock::now() - start);
+        if (sum != 0) {
+            std::cerr << "unexpected payload\n";
+        }
+        return static_cast<double>(created) / elapsed.count();
+    };
+
+    report("create_scan_destroy", "makeShared", rate([&] {
+               objects.reserve(kObjects);
+               for (size_t i = 0; i < kObjects; ++i) {
+                   objects.push_back(makeShared<Payload>());
+               }
+           }),
+           "objects/s");
+    report("create_scan_destroy", "makeSharedBatch", rate([&] {
+               objects = makeSharedBatch<Payload>(kObjects);
+           }),
+           "objects/s");
+}
+
+template <typename P>
+void benchBaseline() {
+    benchHandles<P>();
+    benchContention<P>();
+    benchMemory<P>();
+}
+
+// One reader scans the payload while writers copy and destroy handles to it.
+template <typename Factory>
+double readerThroughput(Factory factory, int writers) {
+    SharedPtr<Payload> shared = factory();
+    std::atomic<bool> stop = false;
+    std::vector<std::thread> threads;
+    threads.reserve(writers);
+    for (int i = 0; i < writers; ++i) {
+        threads.emplace_back([&shared, &stop] {
+            while (!stop.load(std::memory_order_relaxed)) {
+                SharedPtr<Payload> copy = shared;
+            }
+        });
+    }
+
+    const Payload* payload = shared.get();
+    int64_t scans = 0;
+    int64_t sum = 0;
+    auto start = Clock::now();
+    while (Clock::now() - start < kDuration) {
+        for (int i = 0; i < 1'000; ++i) {
+            for (int value : payload->values) {
+                sum += value;
+            }
+            std::atomic_signal_fence(std::memory_order_seq_cst);
+        }
+        scans += 1'000;
+    }
+    auto elapsed = std::chrono::duration<double>(Clock::now() - start);
+
+    stop = true;
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    if (sum != 0) {
+        std::cerr << "unexpected payload\n";
+    }
+    return static_cast<double>(scans) / elapsed.count();
+}
+
+void benchIsolatedLayout() {
+    auto fused = [] {
+        return makeShared<Payload>();
+    };
+    auto isolated = [] {
+        return makeSharedIsolated<Payload>();
+    };
+    for (int writers : {1, 3}) {
+        std::string name = "reader_scan_" + std::to_string(writers) + "w";
+        report(name, "makeShared", readerThroughput(fused, writers),
+               "scans/s");
+        report(name, "makeSharedIsolated", readerThroughput(isolated, writers),
+               "scans/s");
+    }
+}
+
+// Readers take snapshots of a shared slot while one writer republishes it.
+template <typename Load, typename Store>
+double snapshotThroughput(Load load, Store store, int readers) {
+    std::atomic<bool> stop = false;
+    std::atomic<int64_t> loads = 0;
+    std::vector<std::thread> threads;
+    threads.reserve(readers);
+    for (int i = 0; i < readers; ++i) {
+        threads.emplace_back([&load, &stop, &loads] {
+            int64_t local = 0;
+            while (!stop.load(std::memory_order_relaxed)) {
+                auto snapshot = load();
+                local += snapshot->values[0] + 1;
+            }
+            loads += local;
+        });
+    }
+
+    auto start = Clock::now();
+    while (Clock::now() - start < kDuration) {
+        store(makeShared<Payload>());
+        std::this_thread::sleep_for(std::chrono::microseconds(100));
+    }
+    stop = true;
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    auto elapsed = std::chrono::duration<double>(Clock::now() - start);
+    return static_cast<double>(loads.load()) / elapsed.count();
+}
+
+void benchAtomicLoad() {
+    AtomicSharedPtr<Payload> atomic_slot(makeShared<Payload>());
+    auto atomic_load = [&atomic_slot] {
+        return atomic_slot.load();
+    };
+    auto atomic_borrow = [&atomic_slot] {
+        return atomic_slot.borrow();
+    };
+    auto atomic_store = [&atomic_slot](SharedPtr<Payload> value) {
+        atomic_slot.store(std::move(value));
+    };
+
+    std::mutex mutex;
+    SharedPtr<Payload> locked_slot = makeShared<Payload>();
+    auto locked_load = [&mutex, &locked_slot] {
+        std::lock_guard<std::mutex> lock(mutex);
+        return locked_slot;
+    };
+    auto locked_store = [&mutex, &locked_slot](SharedPtr<Payload> value) {
+        std::lock_guard<std::mutex> lock(mutex);
+        locked_slot = std::move(value);
+    };
+
+    for (int readers : {1, 4}) {
+        std::string name = "snapshot_load_" + std::to_string(readers) + "r";
+        report(name, "AtomicSharedPtr",
+               snapshotThroughput(atomic_load, atomic_store, readers),
+               "loads/s");
+        report(name, "AtomicSharedPtr::borrow",
+               snapshotThroughput(atomic_borrow, atomic_store, readers),
+               "loads/s");
+        report(name, "mutex",
+               snapshotThroughput(locked_load, locked_store, readers),
+               "loads/s");
+    }
+}
+
+// Copies and then destroys a container in which every handle repeats one
+// object, per element or with shareN / releaseN.
+void benchBatchedCopy() {
+    constexpr size_t kHandles = 10'000;
+    std::vector<SharedPtr<Payload>> source(kHandles, makeShared<Payload>());
+    std::vector<SharedPtr<Payload>> copy;
+    copy.reserve(kHandles);
+
+    auto rate = [&](auto round) {
+        int64_t rounds = 0;
+        auto start = Clock::now();
+        while (Clock::now() - start < kDuration) {
+            round();
+            ++rounds;
+        }
+        auto elapsed = std::chrono::duration<double>(Clock::now() - start);
+        return static_cast<double>(rounds * kHandles) / elapsed.count();
+    };
+
+    report("copy_destroy_vector", "per_element", rate([&] {
+               copy.assign(source.begin(), source.end());
+               copy.clear();
+           }),
+           "handles/s");
+    report("copy_destroy_vector", "shareN_releaseN", rate([&] {
+               shareN(source.begin(), kHandles, std::back_inserter(copy));
+               releaseN(copy.begin(), kHandles);
+               copy.clear();
+           }),
+           "handles/s");
+}
+
+struct RecursiveLink {
+    SharedPtr<RecursiveLink> next;
+};
+
+struct IterativeLink : EnableIterativeDestruction {
+    SharedPtr<IterativeLink> next;
+};
+
+// Builds and drops chains short enough for the recursive teardown to fit
+// on the stack; only the drop is timed.
+template <typename Link>
+double chainTeardownRate() {
+    constexpr int kLength = 10'000;
+    int64_t nodes = 0;
+    Clock::duration spent{};
+    while (spent < kDuration) {
+        SharedPtr<Link> head;
+        for (int i = 0; i < kLength; ++i) {
+            auto link = makeShared<Link>();
+            link->next = std::move(head);
+            head = std::move(link);
+        }
+        auto start = Clock::now();
+        head.reset();
+        spent += Clock::now() - start;
+        nodes += kLength;
+    }
+    return static_cast<double>(nodes) /
+           std::chrono::duration<double>(spent).count();
+}
+
+void benchChainTeardown() {
+    report("chain_teardown", "recursive", chainTeardownRate<RecursiveLink>(),
+           "nodes/s");
+    report("chain_teardown", "iterative", chainTeardownRate<IterativeLink>(),
+           "nodes/s");
+}
+
+}  // namespace
+
+void* operator new(size_t size) {
+    allocatedBytes() += size;
+    if (void* memory = std::malloc(size == 0 ? 1 : size)) {
+        return memory;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void* ptr) noexcept {
+    std::free(ptr);
+}
+
+void operator delete(void* ptr, size_t /*unused*/) noexcept {
+    std::free(ptr);
+}
+
+int main() {
+    std::cout << "benchmark,variant,value,unit\n";
+    benchBaseline<OwnPointers>();
+    benchBaseline<StdPointers>();
+    benchIsolatedLayout();
+    benchAtomicLoad();
+    benchBatchedCopy();
+    benchChainTeardown();
+    benchShardedCopy();
+    benchBatchCreate();
+}
@@ -1,7 +1,17 @@
 #include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <iostream>
+#include <iterator>
+#include <map>
 #include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <typeinfo>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 #include "smart_pointers.h"
@@ -14,6 +24,11 @@ struct Base {
 
 struct Derived : public Base {};
 
+// defined in smart_pointers_test_other.cpp
+SharedPtr<void> makeErasedLong(long value);
+SharedPtr<short> makeOwnedShort(short value);
+SharedPtr<unsigned> makeSharedUnsigned(unsigned value);
+
 void test_shared_ptr() {
 
     using std::vector;
@@ -251,20 +266,33 @@ struct Accountant {
 int Accountant::constructed = 0;
 int Accountant::destructed = 0;
 
+struct ThrowingAccountant : Accountant {
+    ThrowingAccountant() {
+        throw std::runtime_error("constructor failed");
+    }
+};
+
 int allocated = 0;
 int deallocated = 0;
 
 int allocate_called = 0;
 int deallocate_called = 0;
 
-int new_called = 0;
-int delete_called = 0;
+// std::thread allocates and frees its state on other threads
+std::atomic<int> new_called = 0;
+std::atomic<int> delete_called = 0;
 
 int construct_called = 0;
 int destroy_called = 0;
 
+// global operator new calls made by the current thread, see checkBudget
+thread_local int thread_allocations = 0;
+thread_local size_t thread_allocated_bytes = 0;
+
 void* operator new(size_t n) {
     ++new_called;
+    ++thread_allocations;
+    thread_allocated_bytes += n;
     return std::malloc(n);
 }
 
@@ -273,6 +301,25 @@ void operator delete(void* ptr) noexcept {
     std::free(ptr);
 }
 
+// over-aligned blocks, such as those of makeSharedIsolated, are counted
+// towards the budgets too
+void* operator new(size_t n, std::align_val_t align) {
+    ++thread_allocations;
+    thread_allocated_bytes += n;
+    auto alignment = static_cast<size_t>(align);
+    return std::aligned_alloc(alignment,
+                              (n + alignment - 1) / alignment * alignment);
+}
+
+void operator delete(void* ptr, std::align_val_t /*unused*/) noexcept {
+    std::free(ptr);
+}
+
+void operator delete(void* ptr, size_t /*unused*/,
+                     std::align_val_t /*unused*/) noexcept {
+    std::free(ptr);
+}
+
 struct VerySpecialType {};
 
 void* operator new(size_t n, VerySpecialType /*unused*/) {
@@ -436,24 +483,59 @@ void test_make_allocate_shared() {
     deallocate_called = 0;
     construct_called = 0;
     destroy_called = 0;
+
+    // a throwing constructor gives the block back, whatever its layout
+    Accountant::constructed = 0;
+    Accountant::destructed = 0;
+    {
+        Arena arena(4'096);
+        ArenaAllocator<ThrowingAccountant> alloc(arena);
+        int attempts = 0;
+        int thrown = 0;
+        auto expectThrow = [&attempts, &thrown](auto make) {
+            ++attempts;
+            try {
+                make();
+            } catch (const std::runtime_error&) {
+                ++thrown;
+            }
+        };
+        expectThrow([&alloc] { allocateShared<ThrowingAccountant>(alloc); });
+        expectThrow(
+            [&alloc] { allocateSharedIsolated<ThrowingAccountant>(alloc); });
+#ifdef SMART_POINTERS_THREAD_SAFE
+        expectThrow(
+            [&alloc] { allocateSharedBiased<ThrowingAccountant>(alloc); });
+        expectThrow(
+            [&alloc] { allocateSharedSharded<ThrowingAccountant>(alloc); });
+#endif
+        assert(thrown == attempts);
+        assert(arena.liveBlocks() == 0);
+
+        new_called = 0;
+        delete_called = 0;
+        expectThrow([] { makeShared<ThrowingAccountant>(); });
+        assert(thrown == attempts);
+        assert(new_called == delete_called);
+        assert(Accountant::constructed == attempts);
+    }
+    assert(Accountant::destructed == Accountant::constructed);
+    Accountant::constructed = 0;
+    Accountant::destructed = 0;
 }
 
-/*struct Enabled: public EnableSharedFromThis<Enabled> {
+struct Enabled : public EnableSharedFromThis<Enabled> {
     SharedPtr<Enabled> get_shared() {
         return shared_from_this();
     }
 };
 
 void test_enable_shared_from_this() {
+    // shared_from_this() is noexcept: without an owner it comes back empty
     {
         Enabled e;
-        bool caught = false;
-        try {
-            e.get_shared();
-        } catch (...) {
-            caught = true;
-        }
-        assert(caught);
+        assert(e.get_shared() == nullptr);
+        assert(e.weakFromThis().expired());
     }
 
     auto esp = makeShared<Enabled>();
@@ -467,7 +549,7 @@ void test_enable_shared_from_this() {
     assert(sp.use_count() == 1);
 
     sp.reset();
-}*/
+}
 
 int mother_created = 0;
 int mother_destroyed = 0;
@@ -552,6 +634,7 @@ void test_custom_deleter() {
     MyDeleter deleter;
     int x = 0;
 
+    trimControlBlockPool();
     new_called = 0;
     delete_called = 0;
 
@@ -568,6 +651,9 @@ void test_custom_deleter() {
 
     // 1 for ControlBlock in sp and 1 for makeShared
     assert(new_called == 2);
+    // the ControlBlock in sp went back to the pool
+    assert(delete_called == 1);
+    trimControlBlockPool();
     assert(delete_called == 2);
 
     new_called = 0;
@@ -611,31 +697,2192 @@ void test_custom_deleter() {
     assert(custom_deleter_called == 1);
 }
 
-int main() {
-    //static_assert(!std::is_base_of_v<std::shared_ptr<VerySpecialType>, SharedPtr<VerySpecialType>>,
-    //        "don't try to use std smart pointers");
+struct alignas(64) CacheLineVector {
+    float lanes[16] = {};
+};
 
-    //static_assert(!std::is_base_of_v<std::weak_ptr<VerySpecialType>, WeakPtr<VerySpecialType>>,
-    //        "don't try to use std smart pointers");
+struct alignas(32) PackedVector {
+    double lanes[4];
+    PackedVector(double x) : lanes{x, x, x, x} {}
+};
 
-    std::cerr << "Starting tests..." << std::endl;
+void test_alignment() {
+    for (int i = 0; i < 100; ++i) {
+        auto wide = makeShared<CacheLineVector>();
+        assert(reinterpret_cast<uintptr_t>(wide.get()) % 64 == 0);
+        assert(wide->lanes[15] == 0);
+
+        auto packed = makeShared<PackedVector>(1.5);
+        assert(reinterpret_cast<uintptr_t>(packed.get()) % 32 == 0);
+        assert(packed->lanes[3] == 1.5);
+
+        auto aligned = allocateShared<CacheLineVector>(
+            std::allocator<CacheLineVector>());
+        assert(reinterpret_cast<uintptr_t>(aligned.get()) % 64 == 0);
+
+        auto isolated = makeSharedIsolated<int>(7);
+        assert(reinterpret_cast<uintptr_t>(isolated.get()) % 64 == 0);
+        assert(*isolated == 7);
+        WeakPtr<int> weak_isolated = isolated;
+        isolated.reset();
+        assert(weak_isolated.expired());
+
+        auto small = makeShared<char>('x');
+        assert(*small == 'x');
+        auto padded = makeShared<long double>(2.0L);
+        assert(reinterpret_cast<uintptr_t>(padded.get()) %
+                   alignof(long double) ==
+               0);
+    }
+}
 
-    test_shared_ptr();
-    std::cerr << "Test 1 (shared ptr) passed." << std::endl;
+void test_arrays() {
+    new_called = 0;
+    delete_called = 0;
+    {
+        auto sp = makeShared<int[]>(1'000);
+        assert(new_called == 1);
+        for (int i = 0; i < 1'000; ++i) {
+            assert(sp[i] == 0);
+            sp[i] = i;
+        }
+        WeakPtr<int[]> wp = sp;
+        auto ssp = sp;
+        assert(ssp[999] == 999);
+        assert(wp.use_count() == 2);
+        sp.reset();
+        ssp.reset();
+        assert(wp.expired());
+    }
+    assert(new_called == 1);
+    assert(delete_called == 1);
 
-    test_weak_ptr();
-    std::cerr << "Test 2 (weak ptr) passed." << std::endl;
+    {
+        auto filled = makeShared<int[]>(10, 7);
+        auto fixed = makeShared<double[4]>(2.5);
+        auto zeroed = makeShared<char[3]>();
+        assert(filled[9] == 7);
+        assert(fixed[3] == 2.5);
+        assert(zeroed[2] == 0);
+
+        auto aligned = makeShared<CacheLineVector[]>(3);
+        for (int i = 0; i < 3; ++i) {
+            assert(reinterpret_cast<uintptr_t>(&aligned[i]) % 64 == 0);
+        }
+    }
 
-    test_make_allocate_shared();
-    std::cerr << "Test 3 (make/allocate shared) passed." << std::endl;
+    Accountant::constructed = 0;
+    Accountant::destructed = 0;
+    {
+        auto sp = makeShared<Accountant[]>(5);
+        assert(Accountant::constructed == 5);
+        SharedPtr<Accountant[]> raw(new Accountant[3]);
+        assert(Accountant::constructed == 8);
+    }
+    assert(Accountant::destructed == 8);
+
+    allocated = 0;
+    deallocated = 0;
+    allocate_called = 0;
+    deallocate_called = 0;
+    construct_called = 0;
+    destroy_called = 0;
+    {
+        MyAllocator<Accountant> alloc;
+        auto sp = allocateShared<Accountant[]>(alloc, 3);
+        assert(allocate_called == 1);
+        assert(construct_called == 3);
+        WeakPtr<Accountant[]> wp = sp;
+        sp.reset();
+        assert(destroy_called == 3);
+        assert(deallocated == 0);
+    }
+    assert(allocated == deallocated);
+    assert(deallocate_called == 1);
+    assert(Accountant::destructed == 11);
 
-    //test_enable_shared_from_this();
+    // sizes whose byte count does not fit in size_t are refused up front
+    new_called = 0;
+    bool thrown = false;
+    try {
+        makeShared<int[]>(SIZE_MAX / sizeof(int) + 2);
+    } catch (const std::bad_array_new_length&) {
+        thrown = true;
+    }
+    assert(thrown);
+    assert(new_called == 0);
 
-    test_inheritance_destroy();
-    std::cerr << "Test 4 (inheritance) passed." << std::endl;
+    Accountant::constructed = 0;
+    Accountant::destructed = 0;
+    allocated = 0;
+    deallocated = 0;
+    allocate_called = 0;
+    deallocate_called = 0;
+    construct_called = 0;
+    destroy_called = 0;
+}
 
-    test_custom_deleter();
-    std::cerr << "Test 5 (custom deleter) passed." << std::endl;
+void test_for_overwrite() {
+    new_called = 0;
+    delete_called = 0;
+    {
+        auto buffer = makeSharedForOverwrite<char[]>(4'096);
+        assert(new_called == 1);
+        std::fill(buffer.get(), buffer.get() + 4'096, 'a');
+        assert(buffer[4'095] == 'a');
+
+        auto fixed = makeSharedForOverwrite<int[16]>();
+        fixed[15] = 15;
+        assert(fixed[15] == 15);
+
+        auto single = makeSharedForOverwrite<int>();
+        *single = 42;
+        assert(*single == 42);
+        assert(new_called == 3);
+
+        auto vectors = makeSharedForOverwrite<CacheLineVector>();
+        assert(vectors->lanes[0] == 0);
+    }
+    assert(delete_called == 3);
+
+    Accountant::constructed = 0;
+    Accountant::destructed = 0;
+    {
+        MyAllocator<Accountant> alloc;
+        auto sp = allocateSharedForOverwrite<Accountant>(alloc);
+        auto array = allocateSharedForOverwrite<Accountant[]>(alloc, 4);
+        assert(allocate_called == 2);
+        assert(Accountant::constructed == 5);
+    }
+    assert(Accountant::destructed == 5);
+    assert(allocated == deallocated);
+    assert(deallocate_called == 2);
+
+    Accountant::constructed = 0;
+    Accountant::destructed = 0;
+    allocated = 0;
+    deallocated = 0;
+    allocate_called = 0;
+    deallocate_called = 0;
+    construct_called = 0;
+    destroy_called = 0;
+}
+
+void test_control_block_pool() {
+    trimControlBlockPool();
+    ControlBlockPoolStats before = controlBlockPoolStats();
+    new_called = 0;
+    delete_called = 0;
+
+    for (int i = 0; i < 1'000; ++i) {
+        SharedPtr<int> sp(new int(i));
+        SharedPtr<int> ssp(new int(i), std::default_delete<int>());
+        assert(*sp == *ssp);
+    }
+    // the two blocks alive at a time are allocated once, then reused
+    assert(new_called == 2'000 + 2);
+    assert(delete_called == 2'000);
+
+    ControlBlockPoolStats after = controlBlockPoolStats();
+    assert(after.misses - before.misses == 2);
+    assert(after.hits - before.hits == 1'998);
+    assert(after.releases - before.releases == 2'000);
+    assert(after.hitRate() > 0.5);
+
+    trimControlBlockPool();
+    assert(delete_called == 2'002);
+
+#ifdef SMART_POINTERS_THREAD_SAFE
+    // blocks released on another thread go back to the allocating one
+    {
+        std::vector<SharedPtr<int>> ptrs;
+        for (int i = 0; i < 100; ++i) {
+            ptrs.push_back(SharedPtr<int>(new int(i)));
+        }
+        std::thread([moved = std::move(ptrs)]() mutable {
+            moved.clear();
+            assert(controlBlockPoolStats().releases == 100);
+            assert(controlBlockPoolStats().returns == 100);
+        }).join();
+
+        ptrs.clear();
+        before = controlBlockPoolStats();
+        for (int i = 0; i < 100; ++i) {
+            ptrs.push_back(SharedPtr<int>(new int(i)));
+        }
+        after = controlBlockPoolStats();
+        assert(after.hits - before.hits == 100);
+        assert(after.misses == before.misses);
+    }
+
+    // blocks that outlive their thread are freed by whoever releases them
+    {
+        std::vector<SharedPtr<int>> ptrs;
+        std::thread([&ptrs] {
+            for (int i = 0; i < 100; ++i) {
+                ptrs.push_back(SharedPtr<int>(new int(i)));
+            }
+        }).join();
+        ptrs.clear();
+    }
+    trimControlBlockPool();
+#endif
+}
+
+void test_arena() {
+    Accountant::constructed = 0;
+    Accountant::destructed = 0;
+    new_called = 0;
+
+    Arena arena(4'096);
+    ArenaAllocator<Accountant> alloc(arena);
+    Accountant* first = nullptr;
+    for (int round = 0; round < 3; ++round) {
+        {
+            std::vector<SharedPtr<Accountant>> handles;
+            std::vector<WeakPtr<Accountant>> observers;
+            for (int i = 0; i < 100; ++i) {
+                handles.push_back(allocateShared<Accountant>(alloc));
+                observers.push_back(handles.back());
+            }
+            auto wide = allocateShared<CacheLineVector>(
+                ArenaAllocator<CacheLineVector>(arena));
+            assert(reinterpret_cast<uintptr_t>(wide.get()) % 64 == 0);
+            assert(arena.liveBlocks() == 101);
+
+            if (round == 0) {
+                first = handles.front().get();
+            } else {
+                // reset() handed out the same memory again
+                assert(handles.front().get() == first);
+            }
+            handles.clear();
+            assert(arena.liveBlocks() == 101);
+            bool caught = false;
+            try {
+                arena.reset();
+            } catch (const std::logic_error&) {
+                caught = true;
+            }
+            assert(caught);
+        }
+        assert(arena.liveBlocks() == 0);
+        arena.reset();
+    }
+    assert(Accountant::constructed == 300);
+    assert(Accountant::destructed == 300);
+
+    // vector growth plus the arena chunks, which are kept across rounds
+    int chunks = 0;
+    {
+        Arena counted(4'096);
+        new_called = 0;
+        {
+            ArenaAllocator<int> ints(counted);
+            auto a = allocateShared<int>(ints, 1);
+            auto b = allocateShared<int>(ints, 2);
+            chunks = new_called;
+        }
+        counted.reset();
+        new_called = 0;
+        auto c = allocateShared<int>(ArenaAllocator<int>(counted), 3);
+        assert(new_called == 0);
+    }
+    assert(chunks == 1);
+
+    Accountant::constructed = 0;
+    Accountant::destructed = 0;
+}
+
+struct GraphNode : EnableIntrusiveRefCount<GraphNode> {
+    static int alive;
+
+    int value;
+    IntrusivePtr<GraphNode> next;
+
+    GraphNode(int value) : value(value) {
+        ++alive;
+    }
+    virtual ~GraphNode() {
+        --alive;
+    }
+};
+
+int GraphNode::alive = 0;
+
+struct LabeledNode : GraphNode {
+    LabeledNode() : GraphNode(-1) {}
+};
+
+void test_intrusive_ptr() {
+    static_assert(sizeof(IntrusivePtr<GraphNode>) == sizeof(GraphNode*));
+
+    {
+        IntrusivePtr<GraphNode> head(new GraphNode(0));
+        for (int i = 1; i < 10; ++i) {
+            IntrusivePtr<GraphNode> node(new GraphNode(i));
+            node->next = head;
+            head = std::move(node);
+        }
+        assert(GraphNode::alive == 10);
+        assert(head.use_count() == 1);
+
+        IntrusivePtr<GraphNode> second = head->next;
+        assert(second.use_count() == 2);
+        auto self = second->intrusiveFromThis();
+        assert(self.get() == second.get());
+        assert(second.use_count() == 3);
+
+        head.reset();
+        assert(GraphNode::alive == 9);
+        assert(second.use_count() == 2);
+    }
+    assert(GraphNode::alive == 0);
+
+    {
+        IntrusivePtr<LabeledNode> labeled(new LabeledNode());
+        IntrusivePtr<GraphNode> base = labeled;
+        assert(base.use_count() == 2);
+        labeled.reset();
+        assert(base->value == -1);
+    }
+    assert(GraphNode::alive == 0);
+
+    // objects owned by a control block count through it
+    new_called = 0;
+    {
+        auto sp = makeShared<GraphNode>(1);
+        IntrusivePtr<GraphNode> ip = sp;
+        assert(new_called == 1);
+        assert(sp.use_count() == 2);
+        assert(ip.use_count() == 2);
+
+        WeakPtr<GraphNode> wp = sp;
+        sp.reset();
+        assert(!wp.expired());
+        auto again = ip->intrusiveFromThis();
+        ip.reset();
+        assert(GraphNode::alive == 1);
+        again.reset();
+        assert(wp.expired());
+
+        SharedPtr<GraphNode> raw(new GraphNode(2));
+        IntrusivePtr<GraphNode> from_raw = raw;
+        raw.reset();
+        assert(from_raw->value == 2);
+    }
+    assert(GraphNode::alive == 0);
+
+    // an aliasing SharedPtr cannot lend its block to the pointee
+    {
+        struct Holder {
+            GraphNode node{3};
+        };
+        auto holder = makeShared<Holder>();
+        SharedPtr<GraphNode> member(holder, &holder->node);
+        bool thrown = false;
+        try {
+            IntrusivePtr<GraphNode> ip = member;
+        } catch (const std::invalid_argument&) {
+            thrown = true;
+        }
+        assert(thrown);
+        assert(holder.use_count() == 2);
+
+        auto owner = makeShared<GraphNode>(4);
+        auto other = makeShared<GraphNode>(5);
+        SharedPtr<GraphNode> misplaced(owner, other.get());
+        thrown = false;
+        try {
+            IntrusivePtr<GraphNode> ip = misplaced;
+        } catch (const std::invalid_argument&) {
+            thrown = true;
+        }
+        assert(thrown);
+        assert(owner.use_count() == 2 && other.use_count() == 1);
+
+        SharedPtr<GraphNode> empty(owner, nullptr);
+        IntrusivePtr<GraphNode> from_empty = empty;
+        assert(from_empty.get() == nullptr);
+    }
+    assert(GraphNode::alive == 0);
+}
+
+struct Snapshot {
+    static std::atomic<int> alive;
+
+    int version;
+
+    Snapshot(int version) : version(version) {
+        ++alive;
+    }
+    ~Snapshot() {
+        --alive;
+    }
+};
+
+std::atomic<int> Snapshot::alive = 0;
+
+void test_atomic_shared_ptr() {
+#ifdef SMART_POINTERS_THREAD_SAFE
+    {
+        AtomicSharedPtr<int> slot;
+        assert(slot.is_lock_free());
+        assert(slot.load().get() == nullptr);
+
+        auto first = makeShared<int>(1);
+        slot.store(first);
+        assert(first.use_count() == 2);
+        SharedPtr<int> loaded = slot.load();
+        assert(loaded.get() == first.get());
+        assert(first.use_count() == 3);
+
+        auto second = makeShared<int>(2);
+        SharedPtr<int> expected = second;
+        assert(!slot.compare_exchange_strong(expected, makeShared<int>(3)));
+        assert(expected.get() == first.get());
+        assert(slot.compare_exchange_strong(expected, second));
+        assert(*slot.load() == 2);
+        assert(first.use_count() == 3);
+
+        SharedPtr<int> previous = slot.exchange(SharedPtr<int>());
+        assert(previous.get() == second.get());
+        assert(slot.load().get() == nullptr);
+
+        AtomicWeakPtr<int> weak_slot{WeakPtr<int>(second)};
+        assert(*weak_slot.load().lock() == 2);
+        second.reset();
+        previous.reset();
+        assert(weak_slot.load().expired());
+    }
+
+    {
+        const int kReaders = 3;
+        const int kStores = 2'000;
+
+        AtomicSharedPtr<Snapshot> slot(makeShared<Snapshot>(0));
+        std::atomic<bool> stop = false;
+        std::vector<std::thread> readers;
+        readers.reserve(kReaders);
+        for (int i = 0; i < kReaders; ++i) {
+            readers.emplace_back([&slot, &stop] {
+                int last_version = 0;
+                while (!stop.load()) {
+                    SharedPtr<Snapshot> snapshot = slot.load();
+                    assert(snapshot->version >= last_version);
+                    last_version = snapshot->version;
+                }
+            });
+        }
+        for (int i = 1; i <= kStores; ++i) {
+            if (i % 2 == 0) {
+                slot.store(makeShared<Snapshot>(i));
+            } else {
+                SharedPtr<Snapshot> expected = slot.load();
+                bool swapped = slot.compare_exchange_strong(
+                    expected, makeShared<Snapshot>(i));
+                assert(swapped);
+            }
+        }
+        stop = true;
+        for (auto& reader : readers) {
+            reader.join();
+        }
+        assert(Snapshot::alive == 1);
+    }
+    assert(Snapshot::alive == 0);
+#endif
+}
+
+void test_borrowed_ptr() {
+#ifdef SMART_POINTERS_THREAD_SAFE
+    {
+        AtomicSharedPtr<Snapshot> slot;
+        assert(slot.borrow().get() == nullptr);
+
+        auto first = makeShared<Snapshot>(1);
+        slot.store(first);
+        BorrowedPtr<Snapshot> borrowed = slot.borrow();
+        assert(borrowed->version == 1);
+        assert(first.use_count() == 2);
+
+        // the replaced snapshot outlives the store while it is borrowed
+        first.reset();
+        slot.store(makeShared<Snapshot>(2));
+        assert(Snapshot::alive == 2);
+        assert((*borrowed).version == 1);
+
+        SharedPtr<Snapshot> shared = borrowed.share();
+        assert(shared.use_count() == 2);
+        BorrowedPtr<Snapshot> moved = std::move(borrowed);
+        assert(borrowed.get() == nullptr);
+        moved = BorrowedPtr<Snapshot>();
+        assert(Snapshot::alive == 2);
+        shared.reset();
+        assert(Snapshot::alive == 1);
+
+        BorrowedPtr<Snapshot> outer = slot.borrow();
+        {
+            BorrowedPtr<Snapshot> inner = slot.borrow();
+            assert(inner.get() == outer.get());
+        }
+        slot.store(SharedPtr<Snapshot>());
+        assert(outer->version == 2);
+        outer = BorrowedPtr<Snapshot>();
+        assert(Snapshot::alive == 0);
+    }
+
+    {
+        const int kReaders = 3;
+        const int kStores = 2'000;
+
+        AtomicSharedPtr<Snapshot> slot(makeShared<Snapshot>(0));
+        std::atomic<bool> stop = false;
+        std::vector<std::thread> readers;
+        readers.reserve(kReaders);
+        for (int i = 0; i < kReaders; ++i) {
+            readers.emplace_back([&slot, &stop] {
+                int last_version = 0;
+                while (!stop.load()) {
+                    BorrowedPtr<Snapshot> snapshot = slot.borrow();
+                    assert(snapshot->version >= last_version);
+                    last_version = snapshot->version;
+                }
+            });
+        }
+        for (int i = 1; i <= kStores; ++i) {
+            slot.store(makeShared<Snapshot>(i));
+        }
+        stop = true;
+        for (auto& reader : readers) {
+            reader.join();
+        }
+        assert(Snapshot::alive == 1);
+        assert(slot.borrow()->version == kStores);
+    }
+    assert(Snapshot::alive == 0);
+#endif
+}
+
+// accepts a fixed number of handles, then throws
+struct LimitedSink {
+    std::vector<SharedPtr<int>>* handles;
+    size_t limit;
+
+    LimitedSink& operator*() {
+        return *this;
+    }
+    LimitedSink& operator++() {
+        return *this;
+    }
+    LimitedSink& operator=(SharedPtr<int>&& shp) {
+        if (handles->size() == limit) {
+            throw std::runtime_error("sink is full");
+        }
+        handles->push_back(std::move(shp));
+        return *this;
+    }
+};
+
+void test_batched_counts() {
+    {
+        auto first = makeShared<int>(1);
+        auto second = makeShared<int>(2);
+        std::vector<SharedPtr<int>> source(1'000, first);
+        source.push_back(second);
+        source.push_back(second);
+        source.emplace_back();
+        source.push_back(first);
+        assert(first.use_count() == 1'002);
+
+        std::vector<SharedPtr<int>> copy;
+        copy.reserve(source.size());
+        shareN(source.begin(), source.size(), std::back_inserter(copy));
+        assert(copy.size() == source.size());
+        assert(first.use_count() == 2'003);
+        assert(second.use_count() == 5);
+        assert(copy[1'000].get() == second.get());
+        assert(copy[1'002].get() == nullptr);
+        assert(*copy.back() == 1);
+
+        releaseN(copy.begin(), copy.size());
+        assert(first.use_count() == 1'002);
+        assert(second.use_count() == 3);
+        assert(copy.front().get() == nullptr);
+
+        // partial output keeps the counts exact
+        std::vector<SharedPtr<int>> partial;
+        bool thrown = false;
+        try {
+            shareN(source.begin(), source.size(), LimitedSink{&partial, 10});
+        } catch (const std::runtime_error&) {
+            thrown = true;
+        }
+        assert(thrown);
+        assert(first.use_count() == 1'012);
+        assert(second.use_count() == 3);
+        partial.clear();
+
+        releaseN(source.begin(), source.size());
+        assert(first.use_count() == 1);
+        assert(second.use_count() == 1);
+    }
+
+    // interleaved handles of more blocks than one window holds
+    {
+        std::vector<SharedPtr<int>> blocks;
+        for (int i = 0; i < 20; ++i) {
+            blocks.push_back(makeShared<int>(i));
+        }
+        std::vector<SharedPtr<int>> source;
+        for (int round = 0; round < 3; ++round) {
+            source.insert(source.end(), blocks.begin(), blocks.end());
+        }
+        std::vector<SharedPtr<int>> copy(source.size());
+        shareN(source.begin(), source.size(), copy.begin());
+        for (size_t i = 0; i < source.size(); ++i) {
+            assert(copy[i].get() == source[i].get());
+        }
+        for (const SharedPtr<int>& block : blocks) {
+            assert(block.use_count() == 7);
+        }
+
+        std::vector<SharedPtr<int>> partial;
+        bool thrown = false;
+        try {
+            shareN(source.begin(), source.size(), LimitedSink{&partial, 25});
+        } catch (const std::runtime_error&) {
+            thrown = true;
+        }
+        assert(thrown);
+        assert(blocks[4].use_count() == 9 && blocks[5].use_count() == 8);
+        partial.clear();
+
+        releaseN(source.begin(), source.size());
+        releaseN(copy.begin(), copy.size());
+        for (const SharedPtr<int>& block : blocks) {
+            assert(block.use_count() == 1);
+        }
+    }
+
+#ifdef SMART_POINTERS_THREAD_SAFE
+    {
+        auto biased = makeSharedBiased<int>(3);
+        std::vector<SharedPtr<int>> source(100, biased);
+        std::vector<SharedPtr<int>> copy(100);
+        shareN(source.begin(), source.size(), copy.begin());
+        assert(biased.use_count() == 201);
+        releaseN(source.begin(), source.size());
+        releaseN(copy.begin(), copy.size());
+        assert(biased.use_count() == 1);
+    }
+#endif
+
+    new_called = 0;
+    delete_called = 0;
+    {
+        std::vector<SharedPtr<int>> source(10, makeShared<int>(4));
+        releaseN(source.begin(), source.size());
+        assert(delete_called == 1);
+    }
+    assert(delete_called == new_called);
+}
+
+struct Row {
+    int key;
+    int value;
+};
+
+void test_pointer_casts() {
+    {
+        auto rows = makeShared<Row[]>(4, Row{1, 2});
+        SharedPtr<int> value(rows, &rows[2].value);
+        assert(rows.use_count() == 2);
+        rows.reset();
+        assert(*value == 2);
+        assert(value.use_count() == 1);
+
+        SharedPtr<const int> moved(std::move(value), value.get());
+        assert(value.get() == nullptr);
+        assert(moved.use_count() == 1);
+        assert(*moved == 2);
+    }
+
+    {
+        SharedPtr<Derived> derived = makeShared<Derived>();
+        SharedPtr<Base> base = derived;
+        assert(derived.use_count() == 2);
+
+        SharedPtr<Base> moved = std::move(derived);
+        assert(derived.get() == nullptr);
+        assert(base.use_count() == 2);
+        moved = SharedPtr<Derived>();
+        assert(base.use_count() == 1);
+
+        SharedPtr<Derived> down = staticPointerCast<Derived>(base);
+        assert(down.use_count() == 2);
+        assert(dynamicPointerCast<Derived>(base).get() == down.get());
+        down.reset();
+
+        // a failed rvalue cast leaves its argument alone
+        SharedPtr<Son> son = dynamicPointerCast<Son>(std::move(base));
+        assert(son.get() == nullptr);
+        assert(base.use_count() == 1);
+
+        SharedPtr<Derived> taken = dynamicPointerCast<Derived>(std::move(base));
+        assert(base.get() == nullptr);
+        assert(taken.use_count() == 1);
+
+        SharedPtr<const Derived> constant = taken;
+        SharedPtr<Derived> mutable_again =
+            constPointerCast<Derived>(std::move(constant));
+        assert(constant.get() == nullptr);
+        assert(mutable_again.get() == taken.get());
+        assert(taken.use_count() == 2);
+
+        SharedPtr<Base> upcast = staticPointerCast<Base>(std::move(taken));
+        assert(taken.get() == nullptr);
+        assert(upcast.use_count() == 2);
+    }
+
+    {
+        SharedPtr<Derived> derived = makeShared<Derived>();
+        WeakPtr<Derived> weak_derived = derived;
+        WeakPtr<Base> weak_base = std::move(weak_derived);
+        assert(weak_derived.expired());
+        assert(weak_base.lock().get() == derived.get());
+
+        WeakPtr<Base> assigned;
+        assigned = derived;
+        assert(!assigned.expired());
+        assigned = WeakPtr<Derived>();
+        assert(assigned.expired());
+        assert(derived.use_count() == 1);
+    }
+}
+
+void test_compact_shared_ptr() {
+    static_assert(sizeof(CompactSharedPtr<Row>) == sizeof(void*));
+
+    auto compact = makeSharedCompact<Row>(Row{3, 4});
+    assert(compact->value == 4);
+    assert(compact.use_count() == 1);
+
+    SharedPtr<Row> shared = compact;
+    assert(shared.get() == compact.get());
+    assert(compact.use_count() == 2);
+
+    std::vector<CompactSharedPtr<Row>> index(100,
+                                             CompactSharedPtr<Row>(shared));
+    assert(shared.use_count() == 102);
+    index.clear();
+
+    CompactSharedPtr<Row> moved(std::move(shared));
+    assert(shared.get() == nullptr);
+    assert(moved.use_count() == 2);
+    SharedPtr<Row> back = std::move(moved);
+    assert(moved.get() == nullptr);
+    assert(back.use_count() == 2);
+
+    assert(CompactSharedPtr<Row>(SharedPtr<Row>()).get() == nullptr);
+    assert(CompactSharedPtr<Row>::isCompactible(makeShared<Row>()));
+    assert(!CompactSharedPtr<Row>::isCompactible(SharedPtr<Row>(new Row())));
+    assert(!CompactSharedPtr<Row>::isCompactible(makeSharedIsolated<Row>()));
+    // makeShared blocks from another file have the same manager
+    assert(CompactSharedPtr<unsigned>::isCompactible(makeSharedUnsigned(5)));
+    assert(*CompactSharedPtr<unsigned>(makeSharedUnsigned(5)) == 5);
+
+    auto pair = makeShared<std::pair<Row, Row>>();
+    SharedPtr<Row> aliased(pair, &pair->second);
+    bool thrown = false;
+    try {
+        CompactSharedPtr<Row> rejected(aliased);
+    } catch (const std::invalid_argument&) {
+        thrown = true;
+    }
+    assert(thrown);
+    assert(pair.use_count() == 2);
+
+    compact.reset();
+    assert(back.use_count() == 1);
+}
+
+void test_weak_ptr_table() {
+    new_called = 0;
+    delete_called = 0;
+    {
+        WeakPtrTable<int, Row> table;
+        WeakPtrTable<int, Row> other;
+        auto first = makeShared<Row>(Row{1, 10});
+        auto second = makeShared<Row>(Row{2, 20});
+        auto third = makeShared<Row>(Row{3, 30});
+        table.insert(1, first);
+        table.insert(2, second);
+        table.insert(3, third);
+        other.insert(2, second);
+        assert(table.size() == 3);
+        assert(table.lock(2)->value == 20);
+        assert(table.lock(4).get() == nullptr);
+
+        second.reset();
+        assert(table.lock(2).get() == nullptr);
+        assert(table.size() == 3);
+        assert(table.sweep() == 1);
+        assert(table.size() == 2);
+        assert(table.lock(3)->value == 30);
+        assert(table.sweep() == 0);
+
+        // the replaced handle's death must not evict the new one
+        table.insert(1, third);
+        first.reset();
+        assert(table.sweep() == 0);
+        assert(table.lock(1).get() == third.get());
+
+        assert(table.erase(3));
+        assert(!table.erase(3));
+        assert(table.size() == 1);
+        third.reset();
+        assert(table.sweep() == 1);
+        assert(table.size() == 0);
+
+        // other has not swept yet and still pins the block of second
+        assert(other.size() == 1);
+    }
+    assert(delete_called == new_called);
+
+    {
+        // a table that never saw the block neither pins it nor hears of it
+        WeakPtrTable<int, Row> table;
+        WeakPtrTable<int, Row> unrelated;
+        auto row = allocateShared<Row>(MyAllocator<Row>(), Row{1, 10});
+        table.insert(1, row);
+        deallocate_called = 0;
+        row.reset();
+        assert(table.sweep() == 1);
+        assert(deallocate_called == 1);
+        assert(unrelated.sweep() == 0);
+    }
+
+#ifdef SMART_POINTERS_THREAD_SAFE
+    {
+        const int kObjects = 1'000;
+
+        WeakPtrTable<int, Row> table;
+        std::vector<SharedPtr<Row>> owners;
+        for (int i = 0; i < kObjects; ++i) {
+            owners.push_back(makeShared<Row>(Row{i, i}));
+            table.insert(i, owners.back());
+        }
+        std::thread releaser([&owners] {
+            for (size_t i = 0; i < owners.size(); i += 2) {
+                owners[i].reset();
+            }
+        });
+        size_t swept = 0;
+        while (swept < kObjects / 2) {
+            swept += table.sweep();
+        }
+        releaser.join();
+        assert(table.sweep() == 0);
+        assert(table.size() == kObjects / 2);
+        assert(table.lock(1)->value == 1);
+    }
+#endif
+}
+
+struct LargeBuffer {
+    char bytes[4'096] = {};
+};
+
+struct ThrowingLargeBuffer : LargeBuffer {
+    ThrowingLargeBuffer() {
+        throw std::runtime_error("constructor failed");
+    }
+};
+
+void test_split_layout() {
+    new_called = 0;
+    delete_called = 0;
+    {
+        auto large = makeSharedSplit<LargeBuffer>();
+        assert(new_called == 2);
+        large->bytes[0] = 'x';
+        WeakPtr<LargeBuffer> observer = large;
+        large.reset();
+        // the payload is gone, the counters stay for the observer
+        assert(delete_called == 1);
+        assert(observer.expired());
+        assert(observer.lock().get() == nullptr);
+    }
+    assert(delete_called == 2);
+
+    {
+        auto small = makeSharedSplit<Row>(Row{5, 6});
+        assert(small->value == 6);
+        WeakPtr<Row> observer = small;
+        SharedPtr<Row> copy = observer.lock();
+        assert(copy.use_count() == 2);
+        assert(!CompactSharedPtr<Row>::isCompactible(small));
+    }
+
+    // the split layout is opt-in: large makeShared objects stay fused
+    {
+        auto fused = makeShared<LargeBuffer>();
+        assert(CompactSharedPtr<LargeBuffer>::isCompactible(fused));
+        CompactSharedPtr<LargeBuffer> compact(std::move(fused));
+        assert(compact->bytes[0] == 0);
+        auto overwrite = makeSharedForOverwrite<LargeBuffer>();
+        assert(CompactSharedPtr<LargeBuffer>::isCompactible(overwrite));
+    }
+
+    bool thrown = false;
+    try {
+        makeSharedSplit<ThrowingLargeBuffer>();
+    } catch (const std::runtime_error&) {
+        thrown = true;
+    }
+    assert(thrown);
+    assert(delete_called == new_called);
+}
+
+struct BufferPool {
+    int returned = 0;
+};
+
+// stateful, not default-constructible, and counts its own copies
+struct ReturnToPool {
+    static int copies;
+    static int moves;
+
+    BufferPool* pool;
+
+    explicit ReturnToPool(BufferPool* pool) : pool(pool) {}
+    ReturnToPool(const ReturnToPool& other) : pool(other.pool) {
+        ++copies;
+    }
+    ReturnToPool(ReturnToPool&& other) noexcept : pool(other.pool) {
+        ++moves;
+    }
+
+    void operator()(int* buffer) {
+        ++pool->returned;
+        delete buffer;
+    }
+};
+
+int ReturnToPool::copies = 0;
+int ReturnToPool::moves = 0;
+
+// May throw when copied or moved, so a block has to be built from a copy
+// and the original must still work after a failure.
+struct FragileDeleter {
+    static bool fail;
+
+    int* deleted;
+
+    explicit FragileDeleter(int* deleted) : deleted(deleted) {}
+    FragileDeleter(const FragileDeleter& other) : deleted(other.deleted) {
+        if (fail) {
+            throw std::runtime_error("deleter copy failed");
+        }
+    }
+    FragileDeleter(FragileDeleter&& other) : deleted(other.deleted) {
+        other.deleted = nullptr;
+    }
+
+    void operator()(int* object) {
+        ++*deleted;
+        delete object;
+    }
+};
+
+bool FragileDeleter::fail = false;
+
+void test_deleter_storage() {
+    BufferPool pool;
+    {
+        SharedPtr<int> sp(new int(1), ReturnToPool(&pool));
+        assert(ReturnToPool::copies == 0);
+        assert(ReturnToPool::moves == 1);
+
+        ReturnToPool* deleter = getDeleter<ReturnToPool>(sp);
+        assert(deleter != nullptr);
+        assert(deleter->pool == &pool);
+        assert(getDeleter<MyDeleter>(sp) == nullptr);
+
+        SharedPtr<int> copy = sp;
+        assert(getDeleter<ReturnToPool>(copy) == deleter);
+    }
+    assert(pool.returned == 1);
+
+    ReturnToPool::moves = 0;
+    {
+        ReturnToPool lvalue(&pool);
+        MyAllocator<int> alloc;
+        SharedPtr<int> sp(new int(2), lvalue, alloc);
+        assert(ReturnToPool::copies == 1);
+        assert(ReturnToPool::moves == 0);
+    }
+    assert(pool.returned == 2);
+
+    int deleted = 0;
+    FragileDeleter::fail = true;
+    try {
+        SharedPtr<int> sp(new int(3), FragileDeleter(&deleted));
+        assert(false);
+    } catch (const std::runtime_error&) {
+    }
+    assert(deleted == 1);
+
+    std::unique_ptr<int, FragileDeleter> up(new int(4),
+                                            FragileDeleter(&deleted));
+    try {
+        SharedPtr<int> sp(std::move(up));
+        assert(false);
+    } catch (const std::runtime_error&) {
+    }
+    assert(up.get() != nullptr);
+    assert(up.get_deleter().deleted == &deleted);
+    FragileDeleter::fail = false;
+    {
+        SharedPtr<int> sp(std::move(up));
+        assert(up.get() == nullptr);
+    }
+    assert(deleted == 2);
+
+    assert(getDeleter<ReturnToPool>(makeShared<int>(3)) == nullptr);
+    assert(getDeleter<ReturnToPool>(SharedPtr<int>()) == nullptr);
+    assert(getDeleter<std::default_delete<int>>(SharedPtr<int>(new int)) !=
+           nullptr);
+    // the deleter key is shared with blocks made in other files
+    assert(getDeleter<std::default_delete<short>>(makeOwnedShort(1)) !=
+           nullptr);
+}
+
+// Records whether constructing a vector element changed its use_count,
+// which is what a copy during reallocation would do.
+template <typename T>
+struct CountChangeSpy {
+    using value_type = T;
+
+    static int constructs;
+    static int count_changes;
+
+    CountChangeSpy() = default;
+    template <typename U>
+    CountChangeSpy(const CountChangeSpy<U>& /*unused*/) {}
+
+    T* allocate(size_t n) {
+        return std::allocator<T>().allocate(n);
+    }
+    void deallocate(T* ptr, size_t n) {
+        std::allocator<T>().deallocate(ptr, n);
+    }
+
+    template <typename U, typename Source>
+    void construct(U* element, Source&& source) {
+        uint before = source.use_count();
+        new (element) U(std::forward<Source>(source));
+        ++constructs;
+        if (element->use_count() != before) {
+            ++count_changes;
+        }
+    }
+
+    template <typename U>
+    bool operator==(const CountChangeSpy<U>& /*unused*/) const {
+        return true;
+    }
+};
+
+template <typename T>
+int CountChangeSpy<T>::constructs = 0;
+template <typename T>
+int CountChangeSpy<T>::count_changes = 0;
+
+void test_noexcept_moves() {
+    static_assert(std::is_nothrow_move_constructible_v<SharedPtr<int>>);
+    static_assert(std::is_nothrow_move_assignable_v<SharedPtr<int>>);
+    static_assert(std::is_nothrow_swappable_v<SharedPtr<int>>);
+    static_assert(std::is_nothrow_move_constructible_v<WeakPtr<int>>);
+    static_assert(std::is_nothrow_move_assignable_v<WeakPtr<int>>);
+    static_assert(std::is_nothrow_move_constructible_v<SharedPtr<int[]>>);
+    static_assert(
+        std::is_nothrow_move_constructible_v<CompactSharedPtr<Row>>);
+    static_assert(noexcept(std::declval<SharedPtr<int>&>().reset()));
+
+    using Spy = CountChangeSpy<SharedPtr<int>>;
+    {
+        std::vector<SharedPtr<int>, Spy> handles;
+        for (int i = 0; i < 1'000; ++i) {
+            handles.push_back(makeShared<int>(i));
+        }
+        // every push_back constructs once, growth relocates the rest
+        assert(Spy::constructs > 1'000);
+        assert(Spy::count_changes == 0);
+        assert(*handles[500] == 500);
+        assert(handles[500].use_count() == 1);
+    }
+
+    {
+        auto shared = makeShared<int>(1);
+        SharedPtr<int> other = makeShared<int>(2);
+        WeakPtr<int> observer = other;
+        SharedPtr<int>& alias = other;
+        other = std::move(alias);
+        assert(*other == 2);
+        other = std::move(shared);
+        assert(shared.get() == nullptr);
+        assert(observer.expired());
+        assert(*other == 1);
+
+        WeakPtr<int> weak = other;
+        WeakPtr<int> moved;
+        moved = std::move(weak);
+        assert(weak.expired());
+        assert(moved.lock().get() == other.get());
+        moved.reset();
+        assert(moved.expired());
+    }
+}
+
+void test_hash_and_ordering() {
+    auto first = makeShared<Row>(Row{1, 1});
+    auto second = makeShared<Row>(Row{2, 2});
+    SharedPtr<Row> copy = first;
+    SharedPtr<int> member(first, &first->value);
+
+    assert(first == copy);
+    assert(first != second);
+    assert(SharedPtr<Row>() == nullptr);
+    assert(first != nullptr);
+    assert((first < second) == (first.get() < second.get()));
+    assert((first <=> copy) == std::strong_ordering::equal);
+    assert(first > nullptr);
+
+    std::unordered_set<SharedPtr<Row>> live{first, second, copy};
+    assert(live.size() == 2);
+    assert(live.count(first) == 1);
+
+    // the aliased member has the same owner, but a different value
+    assert(member.ownerEqual(first));
+    assert(!member.ownerEqual(second));
+    assert(member.ownerHash() == first.ownerHash());
+    assert(first.ownerBefore(second) != second.ownerBefore(first));
+    assert(!first.ownerBefore(member) && !member.ownerBefore(first));
+
+    std::unordered_map<WeakPtr<Row>, int> labels;
+    labels[WeakPtr<Row>(first)] = 10;
+    labels[WeakPtr<Row>(second)] = 20;
+    labels[WeakPtr<Row>(copy)] += 1;
+    assert(labels.size() == 2);
+    // looked up by SharedPtr, no WeakPtr is created
+    assert(labels.find(first)->second == 11);
+    assert(labels.find(member)->second == 11);
+    // first, copy, member and the one in live
+    assert(first.use_count() == 4);
+
+    std::map<WeakPtr<Row>, int, OwnerLess> ordered;
+    ordered[WeakPtr<Row>(second)] = 2;
+    ordered[WeakPtr<Row>(first)] = 1;
+    assert(ordered.find(second)->second == 2);
+
+    WeakPtr<Row> expired = second;
+    second.reset();
+    // expired WeakPtrs keep their owner identity
+    assert(labels.find(expired)->second == 20);
+    assert(expired.ownerEqual(ordered.find(expired)->first));
+}
+
+void test_deferred_destruction() {
+    {
+        DestructionQueue queue(2);
+        auto first = makeSharedDeferred<Snapshot>(queue, 1);
+        auto second = makeSharedDeferred<Snapshot>(queue, 2);
+        auto third = makeSharedDeferred<Snapshot>(queue, 3);
+        WeakPtr<Snapshot> observer = first;
+        assert(Snapshot::alive == 3);
+
+        first.reset();
+        second.reset();
+        assert(Snapshot::alive == 3);
+        assert(observer.expired());
+        // the backlog is full, so this one is destroyed inline
+        third.reset();
+        assert(Snapshot::alive == 2);
+
+        DestructionQueueStats stats = queue.stats();
+        assert(stats.deferred == 2);
+        assert(stats.overflows == 1);
+        assert(stats.pending == 2);
+        assert(stats.high_water == 2);
+
+        assert(queue.drain(1) == 1);
+        assert(Snapshot::alive == 1);
+        assert(queue.drain() == 1);
+        assert(Snapshot::alive == 0);
+        assert(queue.stats().reclaimed == 2);
+        assert(queue.stats().pending == 0);
+
+        // pending entries are drained by the queue's destructor
+        auto fourth = makeSharedDeferred<Snapshot>(queue, 4);
+        fourth.reset();
+        assert(Snapshot::alive == 1);
+    }
+    assert(Snapshot::alive == 0);
+
+#ifdef SMART_POINTERS_THREAD_SAFE
+    {
+        const int kObjects = 1'000;
+
+        DestructionQueue queue(kObjects);
+        queue.startWorker();
+        for (int i = 0; i < kObjects; ++i) {
+            auto snapshot = makeSharedDeferred<Snapshot>(queue, i);
+        }
+        queue.stopWorker();
+        queue.drain();
+        assert(Snapshot::alive == 0);
+        assert(queue.stats().reclaimed == kObjects);
+    }
+#endif
+}
+
+struct ChainNode : EnableIterativeDestruction {
+    static int alive;
+
+    SharedPtr<ChainNode> next;
+    SharedPtr<ChainNode> side;
+
+    ChainNode(SharedPtr<ChainNode> next) : next(std::move(next)) {
+        ++alive;
+    }
+    ~ChainNode() {
+        --alive;
+    }
+};
+
+int ChainNode::alive = 0;
+
+void test_iterative_destruction() {
+    const int kLength = 1'000'000;
+
+    {
+        SharedPtr<ChainNode> head;
+        for (int i = 0; i < kLength; ++i) {
+            head = makeShared<ChainNode>(std::move(head));
+        }
+        WeakPtr<ChainNode> tail_observer = head;
+        assert(ChainNode::alive == kLength);
+        head.reset();
+        assert(ChainNode::alive == 0);
+        assert(tail_observer.expired());
+    }
+
+    // a deep tree mixing raw-pointer and makeShared blocks
+    {
+        SharedPtr<ChainNode> root;
+        for (int i = 0; i < kLength / 2; ++i) {
+            SharedPtr<ChainNode> parent(new ChainNode(std::move(root)));
+            parent->side = makeShared<ChainNode>(SharedPtr<ChainNode>());
+            root = std::move(parent);
+        }
+        assert(ChainNode::alive == kLength);
+        SharedPtr<ChainNode> middle = root->next->next;
+        root.reset();
+        assert(ChainNode::alive == kLength - 4);
+        middle.reset();
+        assert(ChainNode::alive == 0);
+    }
+}
+
+struct StatsProbe {
+    int value = 0;
+};
+
+void test_shared_ptr_stats() {
+    SharedPtrStatsSnapshot before = sharedPtrStats();
+    auto probe_stats = [](const SharedPtrStatsSnapshot& stats) {
+        for (const SharedPtrTypeStats& type : stats.types) {
+            if (type.name == typeid(StatsProbe).name()) {
+                return type;
+            }
+        }
+        return SharedPtrTypeStats{};
+    };
+
+    WeakPtr<StatsProbe> observer;
+    SharedPtr<StatsProbe> leaked;
+    {
+        SharedPtrStatsSite site("stats test");
+        SharedPtr<StatsProbe> fused = makeShared<StatsProbe>();
+        SharedPtr<StatsProbe> raw(new StatsProbe);
+        SharedPtr<StatsProbe> copy = fused;
+        observer = fused;
+        assert(observer.lock() != nullptr);
+        leaked = raw;
+    }
+    assert(observer.lock() == nullptr);
+
+    SharedPtrStatsSnapshot after = sharedPtrStats();
+    std::ostringstream dump;
+    dumpSharedPtrStats(dump);
+    if constexpr (!kStatsEnabled) {
+        assert(after.types.empty() && after.increments == 0);
+        assert(dump.str().find("leaked") == std::string::npos);
+        return;
+    }
+
+    auto kind = [](BlockKind block_kind) {
+        return static_cast<size_t>(block_kind);
+    };
+    assert(after.created_by_kind[kind(BlockKind::MakeShared)] ==
+           before.created_by_kind[kind(BlockKind::MakeShared)] + 1);
+    assert(after.created_by_kind[kind(BlockKind::RawPointer)] ==
+           before.created_by_kind[kind(BlockKind::RawPointer)] + 1);
+    assert(after.lock_hits == before.lock_hits + 1);
+    assert(after.lock_misses == before.lock_misses + 1);
+    // copy, the locked pointer and leaked
+    assert(after.increments >= before.increments + 3);
+    // the fused block is held by observer alone
+    assert(after.weak_only_bytes - before.weak_only_bytes > 0);
+    assert(after.peak_weak_only_bytes >= after.weak_only_bytes);
+
+    SharedPtrTypeStats probe = probe_stats(after);
+    assert(probe.created == 2 && probe.live == 2);
+    assert(std::any_of(after.sites.begin(), after.sites.end(),
+                       [](const SharedPtrSiteStats& site) {
+                           return site.site == "stats test" &&
+                                  site.created == 2;
+                       }));
+    assert(dump.str().find("leaked") != std::string::npos);
+
+    observer.reset();
+    leaked.reset();
+    SharedPtrStatsSnapshot released = sharedPtrStats();
+    assert(probe_stats(released).live == 0);
+    assert(released.weak_only_bytes == before.weak_only_bytes);
+
+    // blocks made in another file land in the same registry
+    SharedPtr<void> elsewhere = makeErasedLong(1);
+    assert(sharedPtrStats().created_by_kind[kind(BlockKind::MakeShared)] ==
+           released.created_by_kind[kind(BlockKind::MakeShared)] + 1);
+}
+
+struct AllocationBudget {
+    int min_allocations = 0;
+    int max_allocations = 0;
+    size_t max_bytes = 0;
+};
+
+constexpr AllocationBudget kNoAllocations{};
+
+AllocationBudget exactlyOne(size_t max_bytes) {
+    return {1, 1, max_bytes};
+}
+
+AllocationBudget atMost(int allocations, size_t max_bytes) {
+    return {0, allocations, max_bytes};
+}
+
+// Runs op and fails if the global operator new calls it makes on this
+// thread fall outside budget.
+template <typename Op>
+void checkBudget(const char* operation, AllocationBudget budget, Op&& op) {
+    int allocations = thread_allocations;
+    size_t bytes = thread_allocated_bytes;
+    op();
+    allocations = thread_allocations - allocations;
+    bytes = thread_allocated_bytes - bytes;
+    if (allocations < budget.min_allocations ||
+        allocations > budget.max_allocations || bytes > budget.max_bytes) {
+        std::cerr << "allocation budget of " << operation << " exceeded: "
+                  << allocations << " allocations, " << bytes << " bytes"
+                  << std::endl;
+        assert(false);
+    }
+}
+
+void test_allocation_budgets() {
+    // the object plus at most a few words of counters and the manager
+    const size_t kBlockBytes = 4 * sizeof(void*);
+
+    SharedPtr<Derived> derived = makeShared<Derived>();
+    SharedPtr<Base> base;
+    WeakPtr<Derived> weak;
+
+    checkBudget("makeShared", exactlyOne(sizeof(int) + kBlockBytes),
+                [] { SharedPtr<int> sp = makeShared<int>(1); });
+    checkBudget("makeShared<T[]>",
+                exactlyOne(8 * sizeof(int) + 2 * kBlockBytes),
+                [] { SharedPtr<int[]> sp = makeShared<int[]>(8); });
+    checkBudget("makeSharedForOverwrite", exactlyOne(64 + kBlockBytes),
+                [] { auto sp = makeSharedForOverwrite<char[64]>(); });
+    checkBudget("allocateShared", kNoAllocations, [] {
+        auto sp = allocateShared<int>(MyAllocator<int>(), 1);
+    });
+    checkBudget("makeUniqueShareable", exactlyOne(sizeof(int) + kBlockBytes),
+                [] { auto up = makeUniqueShareable<int>(1); });
+    checkBudget("makeSharedCompact", exactlyOne(sizeof(int) + kBlockBytes),
+                [] { auto sp = makeSharedCompact<int>(1); });
+
+    {
+        int* raw = new int(1);
+        // a ControlBlockPool miss allocates the block once
+        checkBudget("pointer constructor", atMost(1, kBlockBytes + 16),
+                    [raw] { SharedPtr<int> sp(raw); });
+    }
+
+    checkBudget("copy", kNoAllocations, [&derived] {
+        SharedPtr<Derived> copy = derived;
+        copy = derived;
+    });
+    checkBudget("move", kNoAllocations, [&derived] {
+        SharedPtr<Derived> moved = std::move(derived);
+        derived = std::move(moved);
+    });
+    checkBudget("converting copy", kNoAllocations,
+                [&derived, &base] { base = derived; });
+    checkBudget("aliasing constructor", kNoAllocations, [&derived] {
+        SharedPtr<Base> alias(derived, derived.get());
+    });
+    checkBudget("pointer casts", kNoAllocations, [&base] {
+        SharedPtr<Derived> down = staticPointerCast<Derived>(base);
+        down = dynamicPointerCast<Derived>(base);
+        SharedPtr<const Base> constant = base;
+        base = constPointerCast<Base>(constant);
+    });
+    checkBudget("weak pointer", kNoAllocations, [&derived, &weak] {
+        weak = derived;
+        WeakPtr<Derived> copy = weak;
+        SharedPtr<Derived> locked = copy.lock();
+        assert(locked == derived);
+    });
+    checkBudget("hash and ordering", kNoAllocations, [&derived, &base] {
+        size_t hash = std::hash<SharedPtr<Derived>>()(derived);
+        hash ^= derived.ownerHash();
+        assert(derived.ownerEqual(base) && !derived.ownerBefore(base));
+        (void)hash;
+    });
+    checkBudget("reset and swap", kNoAllocations, [&derived, &base] {
+        SharedPtr<Derived> other;
+        other.swap(derived);
+        derived.swap(other);
+        base.reset();
+    });
+    checkBudget("getDeleter", kNoAllocations, [&derived] {
+        assert(getDeleter<std::default_delete<Derived>>(derived) == nullptr);
+    });
+
+    // counters and object on cache lines of their own
+    checkBudget("makeSharedIsolated", exactlyOne(2 * kCacheLineSize),
+                [] { auto sp = makeSharedIsolated<int>(1); });
+
+#ifdef SMART_POINTERS_THREAD_SAFE
+    // the owner's queue pointer and the split count come on top
+    const size_t kBiasedBlockBytes = kBlockBytes + 2 * sizeof(void*);
+    checkBudget("makeSharedBiased",
+                exactlyOne(sizeof(int) + kBiasedBlockBytes),
+                [] { auto sp = makeSharedBiased<int>(1); });
+    // the first biased block of a thread also sets up its merge queue
+    std::thread([] {
+        checkBudget(
+            "makeSharedBiased on a new thread",
+            {1, 2,
+             sizeof(int) + kBiasedBlockBytes +
+                 sizeof(detail::BiasedMergeQueue)},
+            [] { auto sp = makeSharedBiased<int>(1); });
+    }).join();
+#endif
+
+#ifdef SMART_POINTERS_THREAD_SAFE
+    {
+        AtomicSharedPtr<Derived> slot(derived);
+        checkBudget("AtomicSharedPtr::load", kNoAllocations,
+                    [&slot, &derived] { assert(slot.load() == derived); });
+        // the first borrow on a thread may register a hazard record
+        checkBudget("AtomicSharedPtr::borrow", atMost(1, 4 * sizeof(void*)),
+                    [&slot, &derived] {
+                        assert(slot.borrow().get() == derived.get());
+                    });
+        checkBudget("AtomicSharedPtr::borrow again", kNoAllocations,
+                    [&slot, &derived] {
+                        assert(slot.borrow().get() == derived.get());
+                    });
+    }
+#endif
+
+    {
+        std::vector<SharedPtr<Derived>> source(16, derived);
+        std::vector<SharedPtr<Derived>> copies;
+        copies.reserve(source.size());
+        checkBudget("shareN and releaseN", kNoAllocations,
+                    [&source, &copies] {
+                        shareN(source.begin(), source.size(),
+                               std::back_inserter(copies));
+                        releaseN(copies.begin(), copies.size());
+                        copies.clear();
+                    });
+    }
+
+    {
+        auto* node = new GraphNode(1);
+        auto shared_node = makeShared<GraphNode>(2);
+        checkBudget("IntrusivePtr", kNoAllocations, [node, &shared_node] {
+            IntrusivePtr<GraphNode> ip(node);
+            IntrusivePtr<GraphNode> copy = ip;
+            copy = IntrusivePtr<GraphNode>(shared_node);
+        });
+    }
+    assert(GraphNode::alive == 0);
+
+    {
+        Arena arena(4'096);
+        ArenaAllocator<int> alloc(arena);
+        // the first block opens a chunk, later ones are carved from it
+        checkBudget("allocateShared from an Arena",
+                    exactlyOne(4'096 + 4 * sizeof(void*)),
+                    [&alloc] { auto sp = allocateShared<int>(alloc, 1); });
+        checkBudget("allocateShared from an Arena again", kNoAllocations,
+                    [&alloc] {
+                        auto sp = allocateShared<int>(alloc, 2);
+                        WeakPtr<int> wp = sp;
+                    });
+        checkBudget("Arena::reset", kNoAllocations, [&arena] {
+            arena.reset();
+        });
+    }
+}
+
+struct Publishable : EnableSharedFromThis<Publishable> {
+    static int alive;
+
+    int value;
+
+    explicit Publishable(int value) : value(value) {
+        ++alive;
+    }
+    ~Publishable() {
+        --alive;
+    }
+};
+
+int Publishable::alive = 0;
+
+struct PublishablePlugin : Base, EnableSharedFromThis<PublishablePlugin> {};
+
+void test_unique_shareable() {
+    {
+        UniquePtr<Publishable> up = makeUniqueShareable<Publishable>(1);
+        assert(up != nullptr && up->value == 1);
+        UniquePtr<Publishable> moved = std::move(up);
+        assert(up == nullptr && (*moved).value == 1);
+    }
+    assert(Publishable::alive == 0);
+
+    {
+        UniquePtr<Publishable> up = makeUniqueShareable<Publishable>(2);
+        Publishable* object = up.get();
+        SharedPtr<Publishable> sp;
+        checkBudget("UniquePtr to SharedPtr", kNoAllocations,
+                    [&] { sp = std::move(up); });
+        assert(up == nullptr);
+        assert(sp.get() == object && sp.use_count() == 1);
+        assert(object->shared_from_this() == sp);
+        assert(CompactSharedPtr<Publishable>::isCompactible(sp));
+
+        WeakPtr<Publishable> wp = sp;
+        sp.reset();
+        assert(wp.expired() && Publishable::alive == 0);
+    }
+
+    // the block remembers the type the object was made as
+    {
+        UniquePtr<PublishablePlugin> up =
+            makeUniqueShareable<PublishablePlugin>();
+        PublishablePlugin* plugin = up.get();
+        assert(plugin->weakFromThis().expired());
+        UniquePtr<Base> base = std::move(up);
+        SharedPtr<Base> shared = std::move(base);
+        SharedPtr<PublishablePlugin> self = plugin->shared_from_this();
+        assert(self.get() == plugin && shared.use_count() == 2);
+    }
+
+    // intrusive references count through the reserved block
+    GraphNode::alive = 0;
+    {
+        UniquePtr<GraphNode> up = makeUniqueShareable<GraphNode>(7);
+        {
+            IntrusivePtr<GraphNode> ip = up->intrusiveFromThis();
+            assert(ip.use_count() == 2);
+        }
+        assert(GraphNode::alive == 1 && up->value == 7);
+        SharedPtr<GraphNode> sp = std::move(up);
+        IntrusivePtr<GraphNode> ip = sp;
+        sp.reset();
+        assert(GraphNode::alive == 1 && ip.use_count() == 1);
+    }
+    assert(GraphNode::alive == 0);
+
+    {
+        SharedPtr<Base> base = makeUniqueShareable<Derived>();
+        assert(base.use_count() == 1);
+        UniquePtr<Derived> empty;
+        SharedPtr<Derived> from_empty = std::move(empty);
+        assert(from_empty == nullptr && from_empty.use_count() == 0);
+    }
+
+    // a std::unique_ptr hands its deleter over by move
+    BufferPool pool;
+    ReturnToPool::copies = 0;
+    ReturnToPool::moves = 0;
+    {
+        std::unique_ptr<int, ReturnToPool> up(new int(3),
+                                              ReturnToPool(&pool));
+        ReturnToPool::moves = 0;
+        SharedPtr<int> sp = std::move(up);
+        assert(up == nullptr && *sp == 3);
+        assert(ReturnToPool::copies == 0 && ReturnToPool::moves == 1);
+        assert(getDeleter<ReturnToPool>(sp)->pool == &pool);
+    }
+    assert(pool.returned == 1);
+
+    // Reference deleters stay with their owner.
+    {
+        ReturnToPool deleter(&pool);
+        std::unique_ptr<int, ReturnToPool&> up(new int(4), deleter);
+        SharedPtr<int> sp = std::move(up);
+        assert(ReturnToPool::copies == 0);
+        assert(&getDeleter<std::reference_wrapper<ReturnToPool>>(sp)->get() ==
+               &deleter);
+    }
+    assert(pool.returned == 2);
+
+    {
+        SharedPtr<int[]> array = std::unique_ptr<int[]>(new int[4]{1, 2, 3});
+        assert(array[2] == 3);
+        SharedPtr<int> empty = std::unique_ptr<int>();
+        assert(empty == nullptr && empty.use_count() == 0);
+    }
+}
+
+void test_sharded() {
+#ifdef SMART_POINTERS_THREAD_SAFE
+    Snapshot::alive = 0;
+    {
+        ShardedSharedPtr<Snapshot> hot = makeSharedSharded<Snapshot>(1);
+        assert(hot.use_count() == 1 && hot->version == 1);
+
+        ShardedSharedPtr<Snapshot> copy = hot;
+        assert(copy.get() == hot.get() && hot.use_count() == 2);
+
+        SharedPtr<Snapshot> plain = copy;
+        WeakPtr<Snapshot> weak = hot;
+        WeakPtr<Snapshot> weak_from_plain = plain;
+        assert(hot.use_count() == 3);
+
+        ShardedSharedPtr<Snapshot> relocked(weak);
+        assert(relocked.get() == hot.get() && hot.use_count() == 4);
+        assert(weak_from_plain.lock().get() == hot.get());
+
+        ShardedSharedPtr<Snapshot> adopted(std::move(plain));
+        assert(plain == nullptr && hot.use_count() == 4);
+
+        hot.reset();
+        copy.reset();
+        relocked.reset();
+        assert(!weak.expired() && Snapshot::alive == 1);
+        adopted = ShardedSharedPtr<Snapshot>();
+        assert(weak.expired() && Snapshot::alive == 0);
+        assert(ShardedSharedPtr<Snapshot>(weak).get() == nullptr);
+    }
+
+    // handles to blocks that are not sharded count like SharedPtr
+    {
+        SharedPtr<int> plain = makeShared<int>(5);
+        ShardedSharedPtr<int> sharded(plain);
+        ShardedSharedPtr<int> copy = sharded;
+        assert(plain.use_count() == 3 && *copy == 5);
+        WeakPtr<int> weak = plain;
+        plain.reset();
+        assert(ShardedSharedPtr<int>(weak).use_count() == 3);
+    }
+
+    // handles travel between threads and are released away from the shard
+    // they were taken on
+    const int kThreads = 4;
+    {
+        ShardedSharedPtr<Snapshot> hot = makeSharedSharded<Snapshot>(2);
+        WeakPtr<Snapshot> weak = hot;
+        std::vector<std::vector<ShardedSharedPtr<Snapshot>>> handed(kThreads);
+        std::vector<std::thread> threads;
+        for (int i = 0; i < kThreads; ++i) {
+            threads.emplace_back([&hot, &weak, &handed, i] {
+                for (int j = 0; j < 10'000; ++j) {
+                    ShardedSharedPtr<Snapshot> copy = hot;
+                    ShardedSharedPtr<Snapshot> locked(weak);
+                    assert(copy->version == 2 && locked.get() == copy.get());
+                }
+                for (int j = 0; j < 100; ++j) {
+                    handed[i].push_back(hot);
+                }
+            });
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        threads.clear();
+        hot.reset();
+        for (int i = 0; i < kThreads; ++i) {
+            threads.emplace_back([&handed, i] {
+                handed[(i + 1) % kThreads].clear();
+            });
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        assert(weak.expired() && Snapshot::alive == 0);
+    }
+
+    // the object dies exactly once when the last handles race
+    for (int round = 0; round < 100; ++round) {
+        ShardedSharedPtr<Snapshot> hot = makeSharedSharded<Snapshot>(3);
+        WeakPtr<Snapshot> weak = hot;
+        std::vector<ShardedSharedPtr<Snapshot>> handles(kThreads, hot);
+        hot.reset();
+        std::vector<std::thread> threads;
+        for (int i = 0; i < kThreads; ++i) {
+            threads.emplace_back([&handles, &weak, i] {
+                ShardedSharedPtr<Snapshot> locked(weak);
+                handles[i].reset();
+            });
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        assert(weak.expired() && Snapshot::alive == 0);
+    }
+#endif
+}
+
+struct PluginA {
+    int id = 1;
+};
+
+struct PluginB : Base {
+    int id = 2;
+};
+
+void test_type_erased() {
+    std::map<std::string, SharedPtr<void>> registry;
+    registry["a"] = makeShared<PluginA>();
+    registry["b"] = SharedPtr<Base>(new PluginB);
+    registry["split"] = makeSharedSplit<LargeBuffer>();
+    SharedPtr<void> erased = registry["a"];
+    assert(erased.use_count() == 2);
+
+    SharedPtr<PluginA> a;
+    checkBudget("sharedCast", kNoAllocations,
+                [&] { a = sharedCast<PluginA>(registry["a"]); });
+    assert(a != nullptr && a->id == 1 && a.use_count() == 3);
+    assert(a.get() == erased.get());
+    assert(sharedCast<const PluginA>(erased)->id == 1);
+    assert(sharedCast<PluginB>(erased) == nullptr);
+
+    // the block knows the type it was created with, not the bases
+    SharedPtr<PluginB> b = sharedCast<PluginB>(registry["b"]);
+    assert(b != nullptr && b->id == 2);
+    assert(sharedCast<Base>(registry["b"]) == nullptr);
+    assert(sharedCast<LargeBuffer>(registry["split"]) != nullptr);
+    assert(sharedCast<int>(SharedPtr<int[]>(makeShared<int[]>(2))) ==
+           nullptr);
+    assert(sharedCast<PluginA>(SharedPtr<void>()) == nullptr);
+
+    // a block made in another translation unit answers to the same key
+    SharedPtr<long> elsewhere = sharedCast<long>(makeErasedLong(7));
+    assert(elsewhere != nullptr && *elsewhere == 7);
+
+    // the rvalue overload only takes the reference on success
+    SharedPtr<void> moved = erased;
+    assert(sharedCast<PluginB>(std::move(moved)) == nullptr);
+    assert(moved != nullptr);
+    SharedPtr<PluginA> taken = sharedCast<PluginA>(std::move(moved));
+    assert(moved == nullptr && taken.use_count() == 4);
+
+    WeakPtr<void> weak = erased;
+    assert(weak.lock() == erased);
+    registry.clear();
+    erased.reset();
+    a.reset();
+    taken.reset();
+    assert(weak.expired() && weak.lock() == nullptr);
+}
+
+struct Ingested {
+    static int alive;
+    static int throw_after;
+
+    int value;
+
+    explicit Ingested(int value) : value(value) {
+        if (throw_after-- == 0) {
+            throw std::runtime_error("ingest failed");
+        }
+        ++alive;
+    }
+    ~Ingested() {
+        --alive;
+    }
+};
+
+int Ingested::alive = 0;
+int Ingested::throw_after = -1;
+
+void test_shared_batch() {
+    const size_t kSize = 100;
+
+    checkBudget("makeSharedBatch", atMost(2, SIZE_MAX),
+                [] { auto batch = makeSharedBatch<Ingested>(kSize, 7); });
+    assert(Ingested::alive == 0);
+
+    allocate_called = 0;
+    deallocate_called = 0;
+    construct_called = 0;
+    destroy_called = 0;
+    {
+        std::vector<SharedPtr<Ingested>> batch =
+            allocateSharedBatch<Ingested>(MyAllocator<Ingested>(), kSize, 3);
+        assert(batch.size() == kSize && Ingested::alive == int(kSize));
+        assert(allocate_called == 1 && construct_called == int(kSize));
+        for (size_t i = 0; i < kSize; ++i) {
+            assert(batch[i]->value == 3 && batch[i].use_count() == 1);
+            // laid out one after another for later scans
+            assert(i == 0 || batch[i].get() > batch[i - 1].get());
+        }
+        assert(sharedCast<Ingested>(batch[5]) == batch[5]);
+
+        // every object has counts of its own
+        SharedPtr<Ingested> kept = batch[10];
+        WeakPtr<Ingested> observer = batch[20];
+        batch.clear();
+        assert(Ingested::alive == 1 && destroy_called == int(kSize) - 1);
+        assert(deallocate_called == 0);
+        assert(kept->value == 3 && observer.expired());
+
+        kept.reset();
+        assert(Ingested::alive == 0 && deallocate_called == 0);
+    }
+    assert(deallocate_called == 1);
+
+    // a throwing constructor leaves nothing behind
+    Ingested::throw_after = 50;
+    bool caught = false;
+    try {
+        makeSharedBatch<Ingested>(kSize, 1);
+    } catch (const std::runtime_error&) {
+        caught = true;
+    }
+    assert(caught && Ingested::alive == 0);
+    Ingested::throw_after = -1;
+
+    assert(makeSharedBatch<Ingested>(0, 1).empty());
+}
+
+struct AsyncHandler : EnableSharedFromThis<AsyncHandler> {
+    int completed = 0;
+};
+
+// a move-only continuation, as executors and coroutine frames hold them
+struct Continuation {
+    KeepAlive<AsyncHandler> handler;
+
+    void operator()() {
+        ++handler->completed;
+    }
+};
+
+void test_keep_alive() {
+    SharedPtr<AsyncHandler> owner = makeShared<AsyncHandler>();
+    KeepAlive<AsyncHandler> token = owner->keepAlive();
+    assert(token.get() == owner.get() && owner.use_count() == 2);
+
+    SharedPtrStatsSnapshot before = sharedPtrStats();
+    std::vector<Continuation> queue;
+    checkBudget("KeepAlive moves", kNoAllocations, [&] {
+        Continuation first{std::move(token)};
+        Continuation second = std::move(first);
+        token = std::move(second.handler);
+    });
+    assert(token != nullptr && owner.use_count() == 2);
+    for (int hop = 0; hop < 10; ++hop) {
+        queue.push_back(Continuation{std::move(token)});
+        token = std::move(queue.back().handler);
+        queue.pop_back();
+    }
+    SharedPtrStatsSnapshot after = sharedPtrStats();
+    assert(after.increments == before.increments);
+    assert(after.decrements == before.decrements);
+    assert(owner.use_count() == 2);
+
+    // the token alone keeps the handler alive
+    queue.push_back(Continuation{std::move(token)});
+    WeakPtr<AsyncHandler> weak = owner->weakFromThis();
+    assert(weak.lock() == owner);
+    assert(owner.use_count() == 2);
+    owner.reset();
+    assert(!weak.expired());
+    queue.back()();
+    assert((*queue.back().handler).completed == 1);
+
+    SharedPtr<AsyncHandler> shared = queue.back().handler.share();
+    assert(shared.use_count() == 2);
+    SharedPtr<AsyncHandler> released =
+        std::move(queue.back().handler).release();
+    assert(queue.back().handler == nullptr && released.use_count() == 2);
+    queue.clear();
+    shared.reset();
+    released.reset();
+    assert(weak.expired());
+
+    // no owner, nothing to keep alive
+    AsyncHandler unowned;
+    assert(unowned.keepAlive() == nullptr);
+    assert(unowned.weakFromThis().expired());
+    assert(unowned.shared_from_this() == nullptr);
+}
+
+void test_multithreaded() {
+#ifdef SMART_POINTERS_THREAD_SAFE
+    const int kThreads = 4;
+    const int kIterations = 100'000;
+
+    Accountant::constructed = 0;
+    Accountant::destructed = 0;
+
+    {
+        auto sp = makeShared<Accountant>();
+        WeakPtr<Accountant> wp = sp;
+        std::vector<std::thread> threads;
+        threads.reserve(kThreads);
+        for (int t = 0; t < kThreads; ++t) {
+            threads.emplace_back([&sp, &wp] {
+                for (int i = 0; i < kIterations; ++i) {
+                    SharedPtr<Accountant> copy = sp;
+                    WeakPtr<Accountant> weak = copy;
+                    auto locked = wp.lock();
+                    assert(locked.get() == copy.get());
+                }
+            });
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        assert(sp.use_count() == 1);
+    }
+    assert(Accountant::constructed == 1);
+    assert(Accountant::destructed == 1);
+
+    // the last owner and lock() race: lock() either wins or sees nullptr
+    for (int i = 0; i < 1'000; ++i) {
+        auto sp = makeShared<Accountant>();
+        WeakPtr<Accountant> wp = sp;
+        std::thread locker([&wp] {
+            auto locked = wp.lock();
+            assert(locked.get() == nullptr || locked.use_count() >= 1);
+        });
+        sp.reset();
+        locker.join();
+        assert(wp.expired());
+    }
+    assert(Accountant::constructed == Accountant::destructed);
+
+    Accountant::constructed = 0;
+    Accountant::destructed = 0;
+#endif
+}
+
+void test_biased() {
+#ifdef SMART_POINTERS_THREAD_SAFE
+    Accountant::constructed = 0;
+    Accountant::destructed = 0;
+
+    {
+        auto sp = makeSharedBiased<Accountant>();
+        WeakPtr<Accountant> wp = sp;
+        {
+            std::vector<SharedPtr<Accountant>> copies(10, sp);
+            assert(sp.use_count() == 11);
+        }
+        assert(sp.use_count() == 1);
+        auto locked = wp.lock();
+        assert(locked.use_count() == 2);
+        sp.reset();
+        locked.reset();
+        assert(wp.expired());
+        assert(wp.lock().get() == nullptr);
+    }
+    assert(Accountant::constructed == 1);
+    assert(Accountant::destructed == 1);
+
+    // references created by the owner die on another thread
+    {
+        auto sp = makeSharedBiased<Accountant>();
+        std::vector<SharedPtr<Accountant>> copies(100, sp);
+        std::thread([moved = std::move(copies)]() mutable {
+            moved.clear();
+        }).join();
+        assert(sp.use_count() == 1);
+        WeakPtr<Accountant> wp = sp;
+        sp.reset();
+        mergeBiasedCounts();
+        assert(wp.expired());
+    }
+    assert(Accountant::destructed == 2);
+
+    // the last reference dies on another thread: the block waits for the
+    // owner to merge it, but no thread may lock it any more
+    {
+        auto sp = makeSharedBiased<Accountant>();
+        WeakPtr<Accountant> wp = sp;
+        std::thread([moved = std::move(sp)]() mutable {
+            moved.reset();
+        }).join();
+        assert(wp.expired());
+        assert(wp.lock().get() == nullptr);
+        std::thread([&wp] {
+            assert(wp.expired());
+            assert(wp.lock().get() == nullptr);
+        }).join();
+        mergeBiasedCounts();
+        assert(Accountant::destructed == 3);
+    }
+
+    // the owner thread exits before foreign references die
+    {
+        SharedPtr<Accountant> sp;
+        std::thread([&sp] {
+            auto local = makeSharedBiased<Accountant>();
+            sp = local;
+        }).join();
+        auto copy = sp;
+        assert(sp.use_count() == 2);
+        sp.reset();
+    }
+    assert(Accountant::destructed == 4);
+    assert(Accountant::constructed == 4);
+
+    Accountant::constructed = 0;
+    Accountant::destructed = 0;
+#endif
+}
+
+int main() {
+    //static_assert(!std::is_base_of_v<std::shared_ptr<VerySpecialType>, SharedPtr<VerySpecialType>>,
+    //        "don't try to use std smart pointers");
+
+    //static_assert(!std::is_base_of_v<std::weak_ptr<VerySpecialType>, WeakPtr<VerySpecialType>>,
+    //        "don't try to use std smart pointers");
+
+    std::cerr << "Starting tests..." << std::endl;
+
+    test_shared_ptr();
+    std::cerr << "Test 1 (shared ptr) passed." << std::endl;
+
+    test_weak_ptr();
+    std::cerr << "Test 2 (weak ptr) passed." << std::endl;
+
+    test_make_allocate_shared();
+    std::cerr << "Test 3 (make/allocate shared) passed." << std::endl;
+
+    test_enable_shared_from_this();
+    std::cerr << "Test 4 (enable shared from this) passed." << std::endl;
+
+    test_inheritance_destroy();
+    std::cerr << "Test 5 (inheritance) passed." << std::endl;
+
+    test_custom_deleter();
+    std::cerr << "Test 6 (custom deleter) passed." << std::endl;
+
+    test_alignment();
+    std::cerr << "Test 7 (alignment) passed." << std::endl;
+
+    test_arrays();
+    std::cerr << "Test 8 (arrays) passed." << std::endl;
+
+    test_for_overwrite();
+    std::cerr << "Test 9 (for overwrite) passed." << std::endl;
+
+    test_control_block_pool();
+    std::cerr << "Test 10 (control block pool) passed." << std::endl;
+
+    test_arena();
+    std::cerr << "Test 11 (arena) passed." << std::endl;
+
+    test_intrusive_ptr();
+    std::cerr << "Test 12 (intrusive ptr) passed." << std::endl;
+
+    test_atomic_shared_ptr();
+    std::cerr << "Test 13 (atomic shared ptr) passed." << std::endl;
+
+    test_borrowed_ptr();
+    std::cerr << "Test 14 (borrowed ptr) passed." << std::endl;
+
+    test_batched_counts();
+    std::cerr << "Test 15 (batched counts) passed." << std::endl;
+
+    test_pointer_casts();
+    std::cerr << "Test 16 (pointer casts) passed." << std::endl;
+
+    test_compact_shared_ptr();
+    std::cerr << "Test 17 (compact shared ptr) passed." << std::endl;
+
+    test_weak_ptr_table();
+    std::cerr << "Test 18 (weak ptr table) passed." << std::endl;
+
+    test_split_layout();
+    std::cerr << "Test 19 (split layout) passed." << std::endl;
+
+    test_deleter_storage();
+    std::cerr << "Test 20 (deleter storage) passed." << std::endl;
+
+    test_noexcept_moves();
+    std::cerr << "Test 21 (noexcept moves) passed." << std::endl;
+
+    test_hash_and_ordering();
+    std::cerr << "Test 22 (hash and ordering) passed." << std::endl;
+
+    test_deferred_destruction();
+    std::cerr << "Test 23 (deferred destruction) passed." << std::endl;
+
+    test_iterative_destruction();
+    std::cerr << "Test 24 (iterative destruction) passed." << std::endl;
+
+    test_shared_ptr_stats();
+    std::cerr << "Test 25 (shared ptr stats) passed." << std::endl;
+
+    test_allocation_budgets();
+    std::cerr << "Test 26 (allocation budgets) passed." << std::endl;
+
+    test_unique_shareable();
+    std::cerr << "Test 27 (unique shareable) passed." << std::endl;
+
+    test_sharded();
+    std::cerr << "Test 28 (sharded counts) passed." << std::endl;
+
+    test_type_erased();
+    std::cerr << "Test 29 (type-erased pointers) passed." << std::endl;
+
+    test_shared_batch();
+    std::cerr << "Test 30 (shared batch) passed." << std::endl;
+
+    test_keep_alive();
+    std::cerr << "Test 31 (keep alive) passed." << std::endl;
+
+    test_multithreaded();
+    std::cerr << "Test 32 (multithreaded) passed." << std::endl;
+
+    test_biased();
+    std::cerr << "Test 33 (biased counting) passed." << std::endl;
 
     std::cout << 0;
 }
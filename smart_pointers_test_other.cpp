@@ -0,0 +1,20 @@
+// A second translation unit for smart_pointers_test.cpp: the blocks made here
+// must be recognised by templates instantiated over there.
+
+#include "smart_pointers.h"
+
+// NOLINTBEGIN
+
+SharedPtr<void> makeErasedLong(long value) {
+    return makeShared<long>(value);
+}
+
+SharedPtr<short> makeOwnedShort(short value) {
+    return SharedPtr<short>(new short(value));
+}
+
+SharedPtr<unsigned> makeSharedUnsigned(unsigned value) {
+    return makeShared<unsigned>(value);
+}
+
+// NOLINTEND